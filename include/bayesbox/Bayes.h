@@ -7,12 +7,20 @@
 #include <cassert>
 #include <stdint.h>
 #include <vector>
+#include <algorithm>
 
 #include <boost/numeric/ublas/vector.hpp>
 #include <boost/numeric/ublas/matrix.hpp>
 #include <boost/numeric/ublas/matrix_proxy.hpp>
 
 #include "RandomGenerator.h"
+#include "common/ThreadPool.h"
+#include "common/AsyncWriter.h"
+#include "common/Tracer.h"
+#include "ChainSnapshot.h"
+#include "ConvergenceMonitor.h"
+#include "ReplicaExchange.h"
+#include "ReplicaStore.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,6 +44,27 @@ public:
     virtual void print(FILE* fp) = 0;
 
     virtual ublas::vector<double> value(const ublas::vector<double>& x) const = 0;
+
+    // same as value(x) but into the caller's storage
+    virtual void value(const ublas::vector<double>& x, ublas::vector<double>& y) const
+    {
+        y = value(x);
+    }
+
+    // flattened parameter values, e.g. for writing or monitoring samples;
+    // needed by the sample writer, snapshots, convergence monitoring and
+    // SummaryPolicy
+    virtual void getValues(std::vector<double>& /* values */) const
+    {
+        VERIFY("parameter does not support getValues()" && false);
+    }
+
+    // inverse of getValues(); needed to gather the samples of distributed
+    // replica exchange
+    virtual void setValues(const std::vector<double>& /* values */)
+    {
+        VERIFY("parameter does not support setValues()" && false);
+    }
 };
 
 
@@ -44,6 +73,25 @@ class IMCMCParameter : public IParameter
 public:
     virtual ~IMCMCParameter() {}
     virtual double energy(std::vector<Data>& dataSet, double& h) = 0;
+
+    // Cheap approximation of energy() for the first stage of delayed
+    // acceptance; without an override the screening passes every proposal
+    // exactly as plain Metropolis would, at the cost of a second energy().
+    virtual double surrogateEnergy(std::vector<Data>& dataSet, double& h) { return energy(dataSet, h); }
+
+    // whether surrogateEnergy() is overridden by a cheaper approximation;
+    // Model::MCMC() does not screen with the fallback above
+    virtual bool hasSurrogate() const { return false; }
+
+    // energy() of the replicas pIndices (all if 0) of replicaSet into E and
+    // H, in one pass over the data for all of them; returns false when the
+    // implementation has no batched kernel for this replica set
+    virtual bool energyBatch(std::vector<IMCMCParameter*>& /* replicaSet */, const std::vector<unsigned>* /* pIndices */,
+                             std::vector<Data>& /* dataSet */, std::vector<double>& /* E */, std::vector<double>& /* H */,
+                             ThreadPool* /* pPool */)
+    {
+        return false;
+    }
     virtual void next(unsigned i) = 0;
     virtual void accept() = 0;
     virtual void reject() = 0;
@@ -51,6 +99,28 @@ public:
     virtual double getTemperature() = 0;
     virtual void setTemperature(double temperature) = 0;
     virtual void swap(IMCMCParameter* pParam) = 0;
+
+    // generator of next(), for samplers which move parameters concurrently
+    virtual void setRng(RandomGenerator& /* rng */)
+    {
+        VERIFY("parameter does not support its own generator" && false);
+    }
+};
+
+
+// What Model::MCMC() keeps of the samples it retains (every step-th after
+// skip), see Model::setRetentionPolicy() and RetentionPolicy.h.  A policy
+// owns the parameter set it is given: it may replace and delete the
+// samples in it (clones from IMCMCParameter::push()).
+class IRetentionPolicy
+{
+public:
+    virtual ~IRetentionPolicy() {}
+
+    virtual void retain(IMCMCParameter& param, std::vector<IMCMCParameter*>& paramSet) = 0;
+
+    // posterior mean of value(x) if the policy can tell it without samples
+    virtual bool value(const ublas::vector<double>& /* x */, ublas::vector<double>& /* y */) const { return false; }
 };
 
 
@@ -60,128 +130,457 @@ template <typename T> void swapPointer(T* a, T* b) { T* tmp = a; a = b; b = tmp;
 class Model
 {
 public:
-    Model(RandomGenerator& rng) : m_pRng(&rng), m_sigma(0), m_Bt(0.0), m_Gt(0.0) {}
+    Model(RandomGenerator& rng) : m_pRng(&rng), m_sigma(0), m_pThreadPool(0), m_pSampleWriter(0), m_progressInterval(0),
+                                     m_pSnapshotPublisher(0), m_snapshotInterval(0),
+                                     m_pConvergenceMonitor(0), m_convergenceChain(0), m_targetEss(0.0), m_maxRhat(0.0),
+                                     m_isDelayedAcceptance(false), m_isBatchEnergy(false), m_pTracer(0), m_pRetentionPolicy(0), m_Bt(0.0), m_Gt(0.0) {}
     ~Model() {}
 
+    // State of an MCMC() run between two iterations, see Sampler.
+    struct MCMCState
+    {
+        MCMCState(int num, int skip, int step, std::vector<IMCMCParameter*>& replicaSet)
+            : num(num), skip(skip), step(step), pReplicaSet(&replicaSet), replicas(replicaSet.size()),
+              i(0), j(0), k(0), isDone(false), isDelayedAcceptance(false) {}
+
+        int num;
+        int skip;
+        int step;
+        std::vector<IMCMCParameter*>* pReplicaSet;
+
+        ReplicaStore replicas;
+        std::vector<unsigned> screened;
+        std::vector<double> values;
+
+        int i;      // iterations
+        int j;      // iterations since the last retained sample
+        int k;      // retained samples
+        bool isDone;
+        bool isDelayedAcceptance;   // every replica has a surrogate, see setDelayedAcceptance()
+    };
+
     void MCMC(int num, int skip, int step, std::vector<IMCMCParameter*>& replicaSet)
     {
-        unsigned acceptNum = 0;
-        unsigned stepCount = 0;
-        
-        int numOfReplica = replicaSet.size();
+        MCMCState run(num, skip, step, replicaSet);
+
+        startMCMC(run);
 
-        double exchangeAcceptCount[numOfReplica];
-        double exchangeTotalCount[numOfReplica];
+        while (iterateMCMC(run))
+            ;
+
+        finishMCMC(run);
+    }
+
+    void startMCMC(MCMCState& run)
+    {
+        std::vector<IMCMCParameter*>& replicaSet = *run.pReplicaSet;
+        ReplicaStore& state = run.replicas;
+        int numOfReplica = replicaSet.size();
 
-        double samplingAcceptCount[numOfReplica];
-        double samplingTotalCount[numOfReplica];
+        run.isDelayedAcceptance = m_isDelayedAcceptance;
 
-        double E[numOfReplica];
-        double H[numOfReplica];
+        for (int l = 0; l < numOfReplica; ++l)
+        {
+            if (!replicaSet[l]->hasSurrogate())
+                run.isDelayedAcceptance = false;
+        }
 
         for (int l = 0; l < numOfReplica; ++l)
         {
-            exchangeAcceptCount[l] = 0;
-            exchangeTotalCount[l] = 0;
-            samplingAcceptCount[l] = 0;
-            samplingTotalCount[l] = 0;
+            state.E[l] = replicaSet[l]->energy(*m_pDataSet, state.H[l]);
 
-            E[l] = replicaSet[l]->energy(*m_pDataSet, H[l]);
+            if (run.isDelayedAcceptance)
+                state.S[l] = replicaSet[l]->surrogateEnergy(*m_pDataSet, state.surrogateH[l]);
         }
+    }
 
-//        for (unsigned i = 0; i < num; ++i)
+    // one iteration; false once the run is done
+    bool iterateMCMC(MCMCState& run)
+    {
+        if (run.isDone)
+            return false;
 
-        int i = 0, j = 0, k = 0;
+        std::vector<IMCMCParameter*>& replicaSet = *run.pReplicaSet;
+        ReplicaStore& state = run.replicas;
+        std::vector<unsigned>& screened = run.screened;
+        std::vector<double>& values = run.values;
+        int numOfReplica = replicaSet.size();
+        int num = run.num, skip = run.skip, step = run.step;
+        int& i = run.i;
+        int& j = run.j;
+        int& k = run.k;
+        bool isDelayedAcceptance = run.isDelayedAcceptance;
 
-        for(;;)
+        if (m_pSampleWriter && m_progressInterval > 0 && (i % m_progressInterval) == 0)
+            m_pSampleWriter->writeMessage(i, "MCMC processing ... E = %f, n = %d", state.E[0], i);
+
+        for (int l = i & 0x1; l < numOfReplica - 1; l += 2)
         {
-            // if ((i % 100) == 0)
-            //     printf("MCMC processing ... E= %f, n = %d\n", E, i);
-            IMCMCParameter* pBParam = NULL;
+            double r = exp((replicaSet[l + 1]->getTemperature() - replicaSet[l]->getTemperature()) * (state.H[l + 1] - state.H[l]));
+
+            bool isExchanged = m_pRng->uniform() < r;
 
-            for (int l = i & 0x1; l < numOfReplica - 1; l += 2)
+            if (m_pTracer)
+                m_pTracer->trace(i, l, TraceEvent::TYPE_EXCHANGE, isExchanged ? TraceEvent::FLAG_ACCEPTED : 0, state.H[l + 1], state.H[l]);
+
+            if (isExchanged)
             {
-                double r = exp((replicaSet[l + 1]->getTemperature() - replicaSet[l]->getTemperature()) * (H[l + 1] - H[l]));
+                replicaSet[l]->swap(replicaSet[l + 1]);
+
+                state.E[l] = replicaSet[l]->energy(*m_pDataSet, state.H[l]);
+                state.E[l + 1] = replicaSet[l + 1]->energy(*m_pDataSet, state.H[l + 1]);
 
-                if (m_pRng->uniform() < r)
+                if (isDelayedAcceptance)
                 {
-                    replicaSet[l]->swap(replicaSet[l + 1]);
+                    state.S[l] = replicaSet[l]->surrogateEnergy(*m_pDataSet, state.surrogateH[l]);
+                    state.S[l + 1] = replicaSet[l + 1]->surrogateEnergy(*m_pDataSet, state.surrogateH[l + 1]);
+                }
 
-                    E[l] = replicaSet[l]->energy(*m_pDataSet, H[l]);
-                    E[l + 1] = replicaSet[l + 1]->energy(*m_pDataSet, H[l + 1]);
+                ++state.exchangeAcceptCount[l];
+            }
+            ++state.exchangeTotalCount[l];
+        }
 
-                    ++exchangeAcceptCount[l];
+        // without a pool, batching or screening every replica proposes and
+        // decides in turn, the order (and random stream) of plain MCMC
+        bool isInterleaved = !m_pThreadPool && !m_isBatchEnergy && !isDelayedAcceptance;
+
+        if (!isInterleaved)
+        {
+            for (int l = 0; l < numOfReplica; ++l)
+                replicaSet[l]->next(i);
+
+            if (isDelayedAcceptance)
+            {
+                evaluateEnergies(replicaSet, 0, state.nextS, state.surrogateH, true);
+
+                screened.clear();
+
+                for (int l = 0; l < numOfReplica; ++l)
+                {
+                    state.isScreened[l] = isAcceptable(state.nextS[l] - state.S[l]);
+
+                    if (state.isScreened[l])
+                        screened.push_back(l);
                 }
-                ++exchangeTotalCount[l];
+
+                // full energy only for the proposals which passed
+                evaluateEnergies(replicaSet, &screened, state.nextE, state.nextH, false);
             }
-        
-            for (int l = 0; l < numOfReplica; ++l)
+            else
             {
-//                 printf("l = %d\n", l);
-                IMCMCParameter* pParam = replicaSet[l];
+                evaluateEnergies(replicaSet, 0, state.nextE, state.nextH, false);
+            }
+        }
 
+        for (int l = 0; l < numOfReplica; ++l)
+        {
+            IMCMCParameter* pParam = replicaSet[l];
+            bool isAccepted;
+
+            if (isInterleaved)
+            {
                 pParam->next(i);
-                double nextE = pParam->energy(*m_pDataSet, H[l]);
-                double dE = nextE - E[l];
+                state.nextE[l] = pParam->energy(*m_pDataSet, state.nextH[l]);
+            }
 
-                bool isAccepted = (dE <= 0) || (m_pRng->uniform() < exp(-dE));
+            if (isDelayedAcceptance)
+            {
+                // second stage: exp(-dE) corrected by the first stage
+                // ratio keeps the exact posterior
+                isAccepted = state.isScreened[l] && isAcceptable((state.nextE[l] - state.E[l]) - (state.nextS[l] - state.S[l]));
+
+                if (state.isScreened[l])
+                    ++state.screenPassCount[l];
+            }
+            else
+            {
+                isAccepted = isAcceptable(state.nextE[l] - state.E[l]);
+            }
+
+            if (m_pTracer)
+            {
+                unsigned flags = (isAccepted ? TraceEvent::FLAG_ACCEPTED : 0)
+                    | (isDelayedAcceptance && state.isScreened[l] ? TraceEvent::FLAG_SCREENED : 0);
+
+                // proposals stopped by the first stage have no energy
+                m_pTracer->trace(i, l, TraceEvent::TYPE_SAMPLING, flags,
+                                 state.isScreened[l] ? state.nextE[l] : state.nextS[l], state.E[l]);
+            }
 
 //                printf("replica = %d, energy = %f, next energy = %f\n", l, E[l], nextE);
 
+            if (isAccepted)
+            {
+                pParam->accept();
+                state.E[l] = state.nextE[l];
+                state.H[l] = state.nextH[l];
+                state.S[l] = state.nextS[l];
+
+                ++state.samplingAcceptCount[l];
+            }
+            else
+            {
+                pParam->reject();
+            }
+
+            ++state.samplingTotalCount[l];
+        }
+
+        IMCMCParameter* pBParam = replicaSet[0];
+
+//            printf("i = %d, j = %d, k = %d\n", i, j, k);
+
+        if (m_pSnapshotPublisher && (i % m_snapshotInterval) == 0)
+        {
+            ChainSnapshot& snapshot = m_pSnapshotPublisher->getBackBuffer();
+
+            snapshot.iteration = i;
+            pBParam->getValues(snapshot.values);
+            snapshot.energies = state.E;
+            snapshot.temperatures.resize(numOfReplica);
+
+            for (int l = 0; l < numOfReplica; ++l)
+                snapshot.temperatures[l] = replicaSet[l]->getTemperature();
+
+            m_pSnapshotPublisher->publish();
+        }
+
+        if (i++ >= skip)
+        {
+            if (++j < step)
+            {
+                return true;
+            }
+
+            j = 0;
+
+            retain(*pBParam);
+
+            if (m_pSampleWriter)
+            {
+                pBParam->getValues(values);
+                m_pSampleWriter->writeSample(i, values);
+            }
+
+            if (m_pConvergenceMonitor)
+            {
+                pBParam->getValues(values);
+                m_pConvergenceMonitor->add(m_convergenceChain, values);
+
+                if ((k % CONVERGENCE_CHECK_INTERVAL) == 0 && m_pConvergenceMonitor->isConverged(m_targetEss, m_maxRhat))
+                {
+                    ++k;
+                    run.isDone = true;
+                    return false;
+                }
+            }
+//                 printf("id = %x\n", (int)pBParam);
+
+            if (++k >= num)
+            {
+                run.isDone = true;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // statistics of the run to stdout and the sample writer
+    void finishMCMC(MCMCState& run)
+    {
+        std::vector<IMCMCParameter*>& replicaSet = *run.pReplicaSet;
+        ReplicaStore& state = run.replicas;
+        int numOfReplica = replicaSet.size();
+        int skip = run.skip, step = run.step;
+        int i = run.i, k = run.k;
+        bool isDelayedAcceptance = run.isDelayedAcceptance;
+
+        for (int l = 0; l < numOfReplica; ++l)
+        {
+            printf("[%f] exchange ratio = %f, accept ratio = %f, last energy = %f\n", replicaSet[l]->getTemperature(),
+                   state.exchangeAcceptCount[l] / state.exchangeTotalCount[l],
+                   state.samplingAcceptCount[l] / state.samplingTotalCount[l],
+                   state.E[l]);
+        }
+
+        if (m_isDelayedAcceptance && !isDelayedAcceptance)
+        {
+            printf("delayed acceptance off: a replica has no surrogate energy\n");
+        }
+
+        if (isDelayedAcceptance)
+        {
+            for (int l = 0; l < numOfReplica; ++l)
+            {
+                printf("[%f] screen ratio = %f, second stage accept ratio = %f\n", replicaSet[l]->getTemperature(),
+                       state.screenPassCount[l] / state.samplingTotalCount[l],
+                       state.screenPassCount[l] > 0 ? state.samplingAcceptCount[l] / state.screenPassCount[l] : 0.0);
+            }
+        }
+
+        if (m_pSampleWriter)
+        {
+            // records the writer could not queue (messages, or samples with dropWhenFull)
+            printf("sampling done = %d, total = %d, initial skip = %d, step = %d, dropped by writer = %llu\n", k, i, skip,
+                   step, static_cast<unsigned long long>(m_pSampleWriter->getNumOfDropped()));
+        }
+        else
+        {
+            printf("sampling done = %d, total = %d, initial skip = %d, step = %d\n", k, i, skip, step);
+        }
+
+        if (m_pConvergenceMonitor)
+        {
+            printf("ESS = %f, R-hat = %f, recommended step = %d\n", m_pConvergenceMonitor->getMinEss(),
+                   m_pConvergenceMonitor->getMaxRhat(), m_pConvergenceMonitor->recommendStep(step));
+        }
+
+        if (m_pSampleWriter)
+        {
+            for (int l = 0; l < numOfReplica; ++l)
+            {
+                m_pSampleWriter->writeMessage(i, "[%f] exchange ratio = %f, accept ratio = %f, last energy = %f",
+                                              replicaSet[l]->getTemperature(),
+                                              state.exchangeAcceptCount[l] / state.exchangeTotalCount[l],
+                                              state.samplingAcceptCount[l] / state.samplingTotalCount[l],
+                                              state.E[l]);
+            }
+
+            m_pSampleWriter->writeMessage(i, "sampling done = %d, total = %d, initial skip = %d, step = %d", k, i, skip, step);
+        }
+    }
+
+    // Replica exchange across processes: replicaSet holds the local replicas
+    // only and exchange decides their temperatures.  Every process has to
+    // call this with the same num, skip and step.  A sample is taken by
+    // the process whose replica is at ladder position 0; a worker streams
+    // it to the coordinator with the next exchange, where it is retained
+    // (through the retention policy, if any) in iteration order.  So the
+    // results (parameter set, sample writer) are the coordinator's; a
+    // worker's parameter set stays empty and it may not have a sample
+    // writer.  The parameters need setValues().
+    void MCMC(int num, int skip, int step, std::vector<IMCMCParameter*>& replicaSet, DistributedExchange& exchange)
+    {
+        int numOfReplica = replicaSet.size();
+
+        VERIFY(numOfReplica == static_cast<int>(exchange.getNumOfLocalReplicas()));
+        VERIFY("only the coordinator writes samples" && (exchange.isCoordinator() || !m_pSampleWriter));
+
+        std::vector<double> E(numOfReplica), H(numOfReplica);
+        std::vector<double> nextE(numOfReplica), nextH(numOfReplica);
+        std::vector<double> samplingAcceptCount(numOfReplica, 0.0);
+        std::vector<double> values;
+        unsigned numOfGathered = 0;
+
+        // carries the samples received from workers
+        std::vector<IMCMCParameter*> scratch;
+
+        if (exchange.isCoordinator())
+            replicaSet[0]->push(scratch);
+
+        for (int l = 0; l < numOfReplica; ++l)
+        {
+            replicaSet[l]->setTemperature(exchange.getTemperature(l));
+            E[l] = replicaSet[l]->energy(*m_pDataSet, H[l]);
+        }
+
+        int i = 0, j = 0, k = 0;
+
+        for (;;)
+        {
+            exchange.exchange(i, &H[0]);
+
+            if (exchange.isCoordinator())
+                numOfGathered += retainGathered(exchange, *scratch[0]);
+
+            for (int l = 0; l < numOfReplica; ++l)
+            {
+                if (replicaSet[l]->getTemperature() != exchange.getTemperature(l))
+                {
+                    replicaSet[l]->setTemperature(exchange.getTemperature(l));
+                    E[l] = replicaSet[l]->energy(*m_pDataSet, H[l]);
+                }
+            }
+
+            for (int l = 0; l < numOfReplica; ++l)
+                replicaSet[l]->next(i);
+
+            evaluateEnergies(replicaSet, 0, nextE, nextH, false);
+
+            for (int l = 0; l < numOfReplica; ++l)
+            {
+                double dE = nextE[l] - E[l];
+                bool isAccepted = (dE <= 0) || (m_pRng->uniform() < exp(-dE));
+
+                if (m_pTracer)
+                    m_pTracer->trace(i, exchange.getIndex(l), TraceEvent::TYPE_SAMPLING, isAccepted ? TraceEvent::FLAG_ACCEPTED : 0, nextE[l], E[l]);
+
                 if (isAccepted)
                 {
-                    pParam->accept();
-                    E[l] = nextE;
+                    replicaSet[l]->accept();
+                    E[l] = nextE[l];
+                    H[l] = nextH[l];
 
                     ++samplingAcceptCount[l];
                 }
                 else
                 {
-                    pParam->reject();
+                    replicaSet[l]->reject();
                 }
-
-                //if (pParam->getTemperature() == 1.0)
-                if (l == 0)
-                {
-                    pBParam = pParam;
-                }
-
-                ++samplingTotalCount[l];
             }
 
-//            printf("i = %d, j = %d, k = %d, r = %d\n", i, j, k, acceptNum);
-
             if (i++ >= skip)
             {
                 if (++j < step)
-                {
                     continue;
-                }
 
                 j = 0;
 
-                pBParam->push(*m_pParamSet);
-//                 printf("id = %x\n", (int)pBParam);
+                for (int l = 0; l < numOfReplica; ++l)
+                {
+                    if (exchange.getIndex(l) != 0)
+                        continue;
+
+                    replicaSet[l]->getValues(values);
+
+                    if (!exchange.isCoordinator())
+                    {
+                        exchange.addSample(i, values);
+                        continue;
+                    }
+
+                    retain(*replicaSet[l]);
+
+                    if (m_pSampleWriter)
+                        m_pSampleWriter->writeSample(i, values);
+                }
 
                 if (++k >= num)
-                {
                     break;
-                }
             }
+        }
 
+        exchange.flush();
 
-//        fprintf(fp, "%f %f\n", *(w1->data), *(w2->data));
+        if (exchange.isCoordinator())
+        {
+            numOfGathered += retainGathered(exchange, *scratch[0]);
+            delete scratch[0];
         }
 
         for (int l = 0; l < numOfReplica; ++l)
         {
-            printf("[%f] exchange ratio = %f, accept ratio = %f, last energy = %f\n", replicaSet[l]->getTemperature(),
-                   (double)exchangeAcceptCount[l] / (double)exchangeTotalCount[l],
-                   (double)samplingAcceptCount[l] / (double)samplingTotalCount[l],
-                   E[l]);
+            printf("[%f] accept ratio = %f, last energy = %f\n", replicaSet[l]->getTemperature(),
+                   samplingAcceptCount[l] / (double)i, E[l]);
         }
 
-        printf("sampling done = %d, total = %d, initial skip = %d, step = %d\n", k, i, skip, step);
+        if (exchange.isCoordinator())
+            exchange.printStatistics(stdout);
+
+        printf("sampling done = %d, gathered = %u, total = %d, initial skip = %d, step = %d\n",
+               k, numOfGathered, i, skip, step);
     }
 
     void printfPramSet(FILE* fp)
@@ -194,7 +593,14 @@ public:
 
     ublas::vector<double> value(const ublas::vector<double>& x) const
     {
-        ublas::vector<double> sum;
+        ublas::vector<double> mean;
+
+        if (m_pRetentionPolicy && m_pRetentionPolicy->value(x, mean))
+            return mean;
+
+        VERIFY("no samples retained (and x is not a query of the retention policy)" && !m_pParamSet->empty());
+
+        ublas::vector<double> sum = ublas::zero_vector<double>(m_pParamSet->front()->value(x).size());
 
         for (std::vector<IMCMCParameter*>::iterator i = m_pParamSet->begin(); i != m_pParamSet->end(); ++i)
         {
@@ -204,8 +610,45 @@ public:
         return sum / m_pParamSet->size();
     }
 
+    // Posterior mean of value() for every row of X, and optionally the
+    // posterior variance.  Queries are spread over the thread pool (if
+    // any) and samples are visited in blocks shared by a block of queries.
+    void predict(const ublas::matrix<double>& X, ublas::matrix<double>& mean, ublas::matrix<double>* pVariance = 0)
+    {
+        VERIFY(!m_pParamSet->empty());
+
+        unsigned dimension = predictDimension(X);
+
+        mean.resize(X.size1(), dimension, false);
+
+        if (pVariance)
+            pVariance->resize(X.size1(), dimension, false);
+
+        PredictTask task(*this, X, &mean, pVariance, 0, 0);
+        parallelQueries(X.size1(), task);
+    }
+
+    // Posterior q-quantile (0 <= q <= 1, linearly interpolated) of value()
+    // for every row of X.
+    void predictQuantile(const ublas::matrix<double>& X, double q, ublas::matrix<double>& result)
+    {
+        VERIFY(!m_pParamSet->empty());
+        VERIFY(q >= 0.0 && q <= 1.0);
+
+        unsigned dimension = predictDimension(X);
+
+        result.resize(X.size1(), dimension, false);
+
+        PredictTask task(*this, X, 0, 0, &result, q);
+        parallelQueries(X.size1(), task);
+    }
+
+    // needs retained samples, e.g. not with SummaryPolicy
     double WAIC()
     {
+        VERIFY("WAIC needs retained samples" && !m_pParamSet->empty());
+        VERIFY(!m_pDataSet->empty());
+
         double sumOfLogProbStar = 0.0;
         double sumOfLogProb = 0.0;
 
@@ -267,9 +710,70 @@ public:
     void setTrueParameterSet(std::vector<IMCMCParameter*>& set) { m_pTrueParamSet = &set; }
     void setDataSet(std::vector<Data>& set) { m_pDataSet = &set; }
 
+    // Evaluates the proposals of all replicas concurrently.  Parameters that
+    // share the same pool for their data loop get the remaining threads.
+    void setThreadPool(ThreadPool& pool) { m_pThreadPool = &pool; }
+
+    // Every retained sample (and every progressInterval iterations a progress
+    // line, 0 = never) is handed to writer in addition to the parameter set.
+    void setSampleWriter(AsyncWriter& writer, int progressInterval = 0)
+    {
+        m_pSampleWriter = &writer;
+        m_progressInterval = progressInterval;
+    }
+
+    // The state of replica 0 and the energies of all replicas are published
+    // every interval iterations, e.g. for a ChainMonitor.
+    void setSnapshotPublisher(SnapshotPublisher& publisher, int interval = 1)
+    {
+        VERIFY(interval > 0);
+
+        m_pSnapshotPublisher = &publisher;
+        m_snapshotInterval = interval;
+    }
+
+    // Retained samples are fed to monitor as chain `chain`; MCMC() then stops
+    // before num samples once every parameter reaches targetEss and, if
+    // maxRhat > 0, R-hat is below maxRhat.  targetEss = 0 only monitors.
+    void setConvergenceMonitor(ConvergenceMonitor& monitor, double targetEss, double maxRhat = 0.0, unsigned chain = 0)
+    {
+        m_pConvergenceMonitor = &monitor;
+        m_targetEss = (targetEss > 0.0) ? targetEss : HUGE_VAL;
+        m_maxRhat = maxRhat;
+        m_convergenceChain = chain;
+    }
+
+    // Delayed acceptance: a proposal is first screened with
+    // IMCMCParameter::surrogateEnergy() and energy() is evaluated only for
+    // those which pass.  Assumes a symmetric proposal, as plain Metropolis.
+    // A run whose replicas do not all have a surrogate (hasSurrogate())
+    // falls back to plain Metropolis rather than evaluate energy() twice.
+    void setDelayedAcceptance(bool isEnabled = true) { m_isDelayedAcceptance = isEnabled; }
+
+    // Opt-in: the energies of two or more replicas are evaluated in one
+    // pass over the data by IMCMCParameter::energyBatch() when the
+    // parameter type has such a kernel (on the pool of setThreadPool(), or
+    // else on that of the parameter).  All replicas then propose before
+    // any decides, which changes the random stream of a seed.
+    void setBatchEnergy(bool isEnabled = true) { m_isBatchEnergy = isEnabled; }
+
+    // Records every exchange and sampling decision of MCMC() to tracer:
+    // the replica is the ladder position, the energies are H for exchanges
+    // and E for sampling.
+    void setTracer(Tracer& tracer) { m_pTracer = &tracer; }
+
+    // Retained samples go through policy instead of all into the parameter
+    // set, e.g. to bound its memory in long runs.  The sample writer and the
+    // convergence monitor still see every retained sample.
+    void setRetentionPolicy(IRetentionPolicy& policy) { m_pRetentionPolicy = &policy; }
+    void resetRetentionPolicy() { m_pRetentionPolicy = 0; }
+
     double prob(const ublas::vector<double>& x, const ublas::vector<double>& y, const IParameter& w)
     {
-        ublas::vector<double> r = y - w.value(x);
+        ublas::vector<double> v = w.value(x);
+        VERIFY("WAIC needs data whose y matches value(x)" && v.size() == y.size());
+
+        ublas::vector<double> r = y - v;
 
 //         return exp(- inner_prod(r, r) / (2 * m_sigma * m_sigma))
 //             / pow(sqrt(2 * M_PI) * m_sigma, static_cast<double>(y.size()));
@@ -278,8 +782,269 @@ public:
     }
 //private:
 
+    static const int CONVERGENCE_CHECK_INTERVAL = 64;
+    static const unsigned QUERY_BLOCK_SIZE = 64;
+    static const unsigned SAMPLE_BLOCK_SIZE = 256;
+
+    void retain(IMCMCParameter& param)
+    {
+        if (m_pRetentionPolicy)
+            m_pRetentionPolicy->retain(param, *m_pParamSet);
+        else
+            param.push(*m_pParamSet);
+    }
+
+    // the samples the coordinator has received from workers, retained
+    // through scratch; returns their number
+    unsigned retainGathered(DistributedExchange& exchange, IMCMCParameter& scratch)
+    {
+        exchange.takeSamples(m_gathered);
+
+        for (unsigned n = 0; n < m_gathered.size(); ++n)
+        {
+            scratch.setValues(m_gathered[n].values);
+            retain(scratch);
+
+            if (m_pSampleWriter)
+                m_pSampleWriter->writeSample(m_gathered[n].iteration, m_gathered[n].values);
+        }
+
+        return m_gathered.size();
+    }
+
+    bool isAcceptable(double dE)
+    {
+        return (dE <= 0) || (m_pRng->uniform() < exp(-dE));
+    }
+
+    // energy() (or surrogateEnergy()) of the replicas pIndices, all if 0;
+    // the batched kernel of the parameter type is tried first
+    void evaluateEnergies(std::vector<IMCMCParameter*>& replicaSet, const std::vector<unsigned>* pIndices,
+                          std::vector<double>& E, std::vector<double>& H, bool isSurrogate)
+    {
+        unsigned num = pIndices ? pIndices->size() : replicaSet.size();
+
+        if (num == 0)
+            return;
+
+        if (!isSurrogate && m_isBatchEnergy && num >= 2 && replicaSet[0]->energyBatch(replicaSet, pIndices, *m_pDataSet, E, H, m_pThreadPool))
+            return;
+
+        EnergyTask task(replicaSet, *m_pDataSet, E, H, pIndices, isSurrogate);
+
+        if (m_pThreadPool)
+        {
+            m_pThreadPool->parallelFor(num, task);
+        }
+        else
+        {
+            for (unsigned n = 0; n < num; ++n)
+                task.run(n);
+        }
+    }
+
+    unsigned predictDimension(const ublas::matrix<double>& X) const
+    {
+        if (X.size1() == 0)
+            return 0;
+
+        ublas::vector<double> x = ublas::row(X, 0);
+        return m_pParamSet->front()->value(x).size();
+    }
+
+    void parallelQueries(unsigned numOfQueries, ITask& task)
+    {
+        unsigned numOfBlocks = (numOfQueries + QUERY_BLOCK_SIZE - 1) / QUERY_BLOCK_SIZE;
+
+        if (m_pThreadPool)
+        {
+            m_pThreadPool->parallelFor(numOfBlocks, task);
+        }
+        else
+        {
+            for (unsigned i = 0; i < numOfBlocks; ++i)
+                task.run(i);
+        }
+    }
+
+    // mean / variance (Welford) of the queries [begin, end)
+    void predictMoments(const ublas::matrix<double>& X, unsigned begin, unsigned end,
+                        ublas::matrix<double>& mean, ublas::matrix<double>* pVariance) const
+    {
+        const std::vector<IMCMCParameter*>& paramSet = *m_pParamSet;
+        unsigned numOfQueries = end - begin;
+        unsigned dimension = mean.size2();
+
+        std::vector< ublas::vector<double> > x(numOfQueries);
+        std::vector< ublas::vector<double> > m(numOfQueries, ublas::zero_vector<double>(dimension));
+        std::vector< ublas::vector<double> > m2(numOfQueries, ublas::zero_vector<double>(dimension));
+        ublas::vector<double> y(dimension);
+
+        for (unsigned q = 0; q < numOfQueries; ++q)
+            x[q] = ublas::row(X, begin + q);
+
+        for (unsigned sb = 0; sb < paramSet.size(); sb += SAMPLE_BLOCK_SIZE)
+        {
+            unsigned se = std::min<unsigned>(sb + SAMPLE_BLOCK_SIZE, paramSet.size());
+
+            for (unsigned q = 0; q < numOfQueries; ++q)
+            {
+                for (unsigned s = sb; s < se; ++s)
+                {
+                    paramSet[s]->value(x[q], y);
+                    VERIFY(y.size() == dimension);
+
+                    for (unsigned d = 0; d < dimension; ++d)
+                    {
+                        double delta = y(d) - m[q](d);
+                        m[q](d) += delta / (s + 1);
+                        m2[q](d) += delta * (y(d) - m[q](d));
+                    }
+                }
+            }
+        }
+
+        for (unsigned q = 0; q < numOfQueries; ++q)
+        {
+            for (unsigned d = 0; d < dimension; ++d)
+            {
+                mean(begin + q, d) = m[q](d);
+
+                if (pVariance)
+                    (*pVariance)(begin + q, d) = m2[q](d) / paramSet.size();
+            }
+        }
+    }
+
+    // quantile of the queries [begin, end)
+    void predictQuantiles(const ublas::matrix<double>& X, unsigned begin, unsigned end,
+                          double quantile, ublas::matrix<double>& result) const
+    {
+        const std::vector<IMCMCParameter*>& paramSet = *m_pParamSet;
+        unsigned numOfQueries = end - begin;
+        unsigned numOfSamples = paramSet.size();
+        unsigned dimension = result.size2();
+
+        // [query][dimension][sample]
+        std::vector<double> values(static_cast<size_t>(numOfQueries) * dimension * numOfSamples);
+        std::vector< ublas::vector<double> > x(numOfQueries);
+        ublas::vector<double> y(dimension);
+
+        for (unsigned q = 0; q < numOfQueries; ++q)
+            x[q] = ublas::row(X, begin + q);
+
+        for (unsigned sb = 0; sb < numOfSamples; sb += SAMPLE_BLOCK_SIZE)
+        {
+            unsigned se = std::min(sb + SAMPLE_BLOCK_SIZE, numOfSamples);
+
+            for (unsigned q = 0; q < numOfQueries; ++q)
+            {
+                for (unsigned s = sb; s < se; ++s)
+                {
+                    paramSet[s]->value(x[q], y);
+                    VERIFY(y.size() == dimension);
+
+                    for (unsigned d = 0; d < dimension; ++d)
+                        values[(static_cast<size_t>(q) * dimension + d) * numOfSamples + s] = y(d);
+                }
+            }
+        }
+
+        double position = quantile * (numOfSamples - 1);
+        unsigned lower = static_cast<unsigned>(position);
+        double fraction = position - lower;
+
+        for (unsigned q = 0; q < numOfQueries; ++q)
+        {
+            for (unsigned d = 0; d < dimension; ++d)
+            {
+                std::vector<double>::iterator first = values.begin() + (static_cast<size_t>(q) * dimension + d) * numOfSamples;
+                std::vector<double>::iterator last = first + numOfSamples;
+
+                std::nth_element(first, first + lower, last);
+                double v = *(first + lower);
+
+                if (lower + 1 < numOfSamples)
+                    v += fraction * (*std::min_element(first + lower + 1, last) - v);
+
+                result(begin + q, d) = v;
+            }
+        }
+    }
+
+    class PredictTask : public ITask
+    {
+    public:
+        PredictTask(const Model& model, const ublas::matrix<double>& X,
+                    ublas::matrix<double>* pMean, ublas::matrix<double>* pVariance,
+                    ublas::matrix<double>* pQuantile, double quantile)
+            : m_model(model), m_X(X), m_pMean(pMean), m_pVariance(pVariance),
+              m_pQuantile(pQuantile), m_quantile(quantile) {}
+
+        void run(unsigned index)
+        {
+            unsigned begin = index * QUERY_BLOCK_SIZE;
+            unsigned end = std::min<unsigned>(begin + QUERY_BLOCK_SIZE, m_X.size1());
+
+            if (m_pQuantile)
+                m_model.predictQuantiles(m_X, begin, end, m_quantile, *m_pQuantile);
+            else
+                m_model.predictMoments(m_X, begin, end, *m_pMean, m_pVariance);
+        }
+
+    private:
+        const Model& m_model;
+        const ublas::matrix<double>& m_X;
+        ublas::matrix<double>* m_pMean;
+        ublas::matrix<double>* m_pVariance;
+        ublas::matrix<double>* m_pQuantile;
+        double m_quantile;
+    };
+
+    class EnergyTask : public ITask
+    {
+    public:
+        // pIndices selects the replicas to evaluate (all by default)
+        EnergyTask(std::vector<IMCMCParameter*>& replicaSet, std::vector<Data>& dataSet,
+                   std::vector<double>& E, std::vector<double>& H,
+                   const std::vector<unsigned>* pIndices = 0, bool isSurrogate = false)
+            : m_replicaSet(replicaSet), m_dataSet(dataSet), m_E(E), m_H(H), m_pIndices(pIndices), m_isSurrogate(isSurrogate) {}
+
+        void run(unsigned index)
+        {
+            unsigned l = m_pIndices ? (*m_pIndices)[index] : index;
+
+            if (m_isSurrogate)
+                m_E[l] = m_replicaSet[l]->surrogateEnergy(m_dataSet, m_H[l]);
+            else
+                m_E[l] = m_replicaSet[l]->energy(m_dataSet, m_H[l]);
+        }
+
+    private:
+        std::vector<IMCMCParameter*>& m_replicaSet;
+        std::vector<Data>& m_dataSet;
+        std::vector<double>& m_E;
+        std::vector<double>& m_H;
+        const std::vector<unsigned>* m_pIndices;
+        bool m_isSurrogate;
+    };
+
     RandomGenerator* m_pRng;
     double m_sigma;
+    ThreadPool* m_pThreadPool;
+    AsyncWriter* m_pSampleWriter;
+    int m_progressInterval;
+    SnapshotPublisher* m_pSnapshotPublisher;
+    int m_snapshotInterval;
+    ConvergenceMonitor* m_pConvergenceMonitor;
+    unsigned m_convergenceChain;
+    double m_targetEss;
+    double m_maxRhat;
+    bool m_isDelayedAcceptance;
+    bool m_isBatchEnergy;
+    Tracer* m_pTracer;
+    IRetentionPolicy* m_pRetentionPolicy;
+    std::vector<DistributedExchange::Sample> m_gathered;    // retainGathered()
     std::vector<IMCMCParameter*>* m_pParamSet;
     std::vector<IMCMCParameter*>* m_pTrueParamSet;
     std::vector<Data>* m_pDataSet;
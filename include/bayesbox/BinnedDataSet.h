@@ -0,0 +1,97 @@
+#ifndef BINNED_DATA_SET_H_
+#define BINNED_DATA_SET_H_
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "bayesbox/Bayes.h"
+#include "common/verify.h"
+
+
+// Sufficient statistics of 1-D data: weighted bin centres.
+//
+// With binWidth = 0 only equal values are merged, which is exact.  With
+// binWidth > 0 the data in [n w, (n + 1) w) are merged into one bin whose
+// centre is their mean; the first order error term of a smooth per-datum
+// function then cancels and what remains is bounded by
+// 1/2 max|f''| getWithinSumOfSquares().
+class BinnedDataSet
+{
+public:
+    BinnedDataSet() : m_binWidth(0.0), m_numOfData(0), m_withinSumOfSquares(0.0) {}
+    BinnedDataSet(const std::vector<Data>& dataSet, double binWidth = 0.0) { set(dataSet, binWidth); }
+
+    void set(const std::vector<Data>& dataSet, double binWidth = 0.0)
+    {
+        VERIFY(binWidth >= 0.0);
+
+        m_binWidth = binWidth;
+        m_numOfData = dataSet.size();
+        m_withinSumOfSquares = 0.0;
+        m_centers.clear();
+        m_weights.clear();
+
+        std::vector<double> y(dataSet.size());
+
+        for (unsigned i = 0; i < dataSet.size(); ++i)
+        {
+            VERIFY(dataSet[i].y.size() == 1);
+            y[i] = dataSet[i].y(0);
+        }
+
+        std::sort(y.begin(), y.end());
+
+        for (unsigned begin = 0; begin < y.size(); )
+        {
+            unsigned end = begin + 1;
+
+            if (binWidth > 0.0)
+            {
+                double bin = floor(y[begin] / binWidth);
+
+                while (end < y.size() && floor(y[end] / binWidth) == bin)
+                    ++end;
+            }
+            else
+            {
+                while (end < y.size() && y[end] == y[begin])
+                    ++end;
+            }
+
+            double sum = 0.0;
+
+            for (unsigned i = begin; i < end; ++i)
+                sum += y[i];
+
+            double center = sum / (end - begin);
+
+            for (unsigned i = begin; i < end; ++i)
+                m_withinSumOfSquares += (y[i] - center) * (y[i] - center);
+
+            m_centers.push_back(center);
+            m_weights.push_back(end - begin);
+
+            begin = end;
+        }
+    }
+
+    unsigned size() const { return m_centers.size(); }
+    unsigned getNumOfData() const { return m_numOfData; }
+    double getBinWidth() const { return m_binWidth; }
+    double getWithinSumOfSquares() const { return m_withinSumOfSquares; }
+
+    const double* getCenters() const { return m_centers.empty() ? 0 : &m_centers[0]; }
+    const double* getWeights() const { return m_weights.empty() ? 0 : &m_weights[0]; }
+
+private:
+    double m_binWidth;
+    unsigned m_numOfData;
+    double m_withinSumOfSquares;
+
+    std::vector<double> m_centers;
+    std::vector<double> m_weights;
+};
+
+
+#endif // BINNED_DATA_SET_H_
@@ -0,0 +1,71 @@
+#ifndef CHAIN_SNAPSHOT_H_
+#define CHAIN_SNAPSHOT_H_
+
+#include <vector>
+#include <stdint.h>
+
+
+struct ChainSnapshot
+{
+    uint64_t iteration;
+    std::vector<double> values;         // current state of replica 0
+    std::vector<double> energies;       // per replica
+    std::vector<double> temperatures;   // per replica
+};
+
+
+// Lock-free triple buffer: the sampler fills and publishes one snapshot
+// while a reader (e.g. a render thread) always gets the latest complete
+// one.  Neither side ever waits for the other.
+class SnapshotPublisher
+{
+public:
+    SnapshotPublisher() : m_back(0), m_middle(1), m_front(2) {}
+
+    // writer side
+
+    ChainSnapshot& getBackBuffer() { return m_buffer[m_back]; }
+
+    void publish()
+    {
+        m_back = exchange(m_middle, m_back | FRESH) & INDEX_MASK;
+    }
+
+    // reader side; returns 0 if nothing new was published since last time
+
+    const ChainSnapshot* acquire()
+    {
+        if (!(m_middle & FRESH))
+            return 0;
+
+        m_front = exchange(m_middle, m_front) & INDEX_MASK;
+        return &m_buffer[m_front];
+    }
+
+    const ChainSnapshot& getFrontBuffer() const { return m_buffer[m_front]; }
+
+private:
+    static const unsigned FRESH = 4;
+    static const unsigned INDEX_MASK = 3;
+
+    static unsigned exchange(volatile unsigned& target, unsigned value)
+    {
+        unsigned old;
+
+        do
+        {
+            old = target;
+        } while (!__sync_bool_compare_and_swap(&target, old, value));
+
+        return old;
+    }
+
+    ChainSnapshot m_buffer[3];
+
+    unsigned m_back;
+    volatile unsigned m_middle;
+    unsigned m_front;
+};
+
+
+#endif // CHAIN_SNAPSHOT_H_
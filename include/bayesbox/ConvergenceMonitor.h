@@ -0,0 +1,363 @@
+#ifndef CONVERGENCE_MONITOR_H_
+#define CONVERGENCE_MONITOR_H_
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "common/verify.h"
+
+
+// Online convergence diagnostics of one or more chains in O(batches)
+// memory per parameter.
+//
+// Every chain keeps at most numOfBatches batch means per parameter; when
+// they are all full, neighbours are merged and the batch size doubles.
+//  - ESS: batch means estimate of the asymptotic variance, n s^2 / (b var_BM)
+//    summed over the chains,
+//  - R-hat: split R-hat over the first and second half of every chain.
+// Short batches see no autocorrelation, so nothing is reported (ESS 0,
+// R-hat +inf, not converged) until every chain is ready: it has at least
+// minNumOfSamples samples and its batches are at least sqrt(n) long (with
+// 64 batches from 2048 samples on).  All methods are thread-safe, so
+// chains running concurrently may share a monitor.
+class ConvergenceMonitor
+{
+public:
+    ConvergenceMonitor(unsigned dimension, unsigned numOfChains = 1, unsigned numOfBatches = 64,
+                       uint64_t minNumOfSamples = 0)
+        : m_dimension(dimension), m_numOfBatches(numOfBatches), m_minNumOfSamples(minNumOfSamples),
+          m_chains(numOfChains)
+    {
+        VERIFY(dimension > 0 && numOfChains > 0);
+        VERIFY(numOfBatches >= 4 && (numOfBatches % 2) == 0);
+        VERIFY(pthread_mutex_init(&m_mutex, 0) == 0);
+
+        for (unsigned c = 0; c < numOfChains; ++c)
+        {
+            m_chains[c].batchSize = 1;
+            m_chains[c].numOfSamples = 0;
+            m_chains[c].batches.resize(dimension);
+            m_chains[c].current.resize(dimension);
+        }
+    }
+
+    ~ConvergenceMonitor()
+    {
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    unsigned getDimension() const { return m_dimension; }
+    unsigned getNumOfChains() const { return m_chains.size(); }
+
+    void add(unsigned chain, const std::vector<double>& values)
+    {
+        VERIFY(chain < m_chains.size() && values.size() == m_dimension);
+
+        Lock lock(m_mutex);
+        Chain& c = m_chains[chain];
+
+        for (unsigned d = 0; d < m_dimension; ++d)
+            c.current[d].add(values[d]);
+
+        ++c.numOfSamples;
+
+        if (c.current[0].count < c.batchSize)
+            return;
+
+        for (unsigned d = 0; d < m_dimension; ++d)
+        {
+            c.batches[d].push_back(c.current[d]);
+            c.current[d] = Moments();
+        }
+
+        if (c.batches[0].size() == m_numOfBatches)
+        {
+            for (unsigned d = 0; d < m_dimension; ++d)
+            {
+                std::vector<Moments>& batches = c.batches[d];
+
+                for (unsigned i = 0; i < m_numOfBatches / 2; ++i)
+                {
+                    batches[i] = batches[2 * i];
+                    batches[i].merge(batches[2 * i + 1]);
+                }
+
+                batches.resize(m_numOfBatches / 2);
+            }
+
+            c.batchSize *= 2;
+        }
+    }
+
+    uint64_t getNumOfSamples() const
+    {
+        Lock lock(m_mutex);
+        uint64_t n = 0;
+
+        for (unsigned c = 0; c < m_chains.size(); ++c)
+            n += m_chains[c].numOfSamples;
+
+        return n;
+    }
+
+    // effective sample size of parameter d summed over the chains (0 until
+    // every chain is ready)
+    double getEss(unsigned d) const
+    {
+        VERIFY(d < m_dimension);
+
+        Lock lock(m_mutex);
+        return ess(d);
+    }
+
+    double getMinEss() const
+    {
+        Lock lock(m_mutex);
+        return minEss();
+    }
+
+    // split R-hat of parameter d over the chains (1.0 for a constant
+    // parameter, and +inf until every chain is ready)
+    double getRhat(unsigned d) const
+    {
+        VERIFY(d < m_dimension);
+
+        Lock lock(m_mutex);
+        return rhat(d);
+    }
+
+    double getMaxRhat() const
+    {
+        Lock lock(m_mutex);
+        return maxRhat();
+    }
+
+    // ESS >= targetEss for every parameter and, if maxRhat > 0, R-hat <= maxRhat
+    bool isConverged(double targetEss, double maxRhat = 0.0) const
+    {
+        Lock lock(m_mutex);
+
+        if (minEss() < targetEss)
+            return false;
+
+        return maxRhat <= 0.0 || this->maxRhat() <= maxRhat;
+    }
+
+    // thinning which makes the retained samples roughly independent, given
+    // the step they were retained with
+    int recommendStep(int step) const
+    {
+        Lock lock(m_mutex);
+        double ess = minEss();
+
+        if (ess <= 0.0)
+            return step;
+
+        // the samples the ESS is based on, i.e. those in full batches
+        double n = 0.0;
+
+        for (unsigned c = 0; c < m_chains.size(); ++c)
+            n += static_cast<double>(m_chains[c].batchSize) * m_chains[c].batches[0].size();
+
+        double tau = n / ess;
+
+        return std::max(1, static_cast<int>(ceil(step * tau)));
+    }
+
+private:
+    // scoped lock of m_mutex
+    class Lock
+    {
+    public:
+        Lock(pthread_mutex_t& mutex) : m_mutex(mutex) { pthread_mutex_lock(&m_mutex); }
+        ~Lock() { pthread_mutex_unlock(&m_mutex); }
+
+    private:
+        pthread_mutex_t& m_mutex;
+    };
+
+    // batches a chain needs at least (two per half for R-hat)
+    static const unsigned MIN_NUM_OF_BATCHES = 4;
+
+    ConvergenceMonitor(const ConvergenceMonitor&);
+    ConvergenceMonitor& operator=(const ConvergenceMonitor&);
+
+    double ess(unsigned d) const
+    {
+        if (!isReady())
+            return 0.0;
+
+        double ess = 0.0;
+
+        for (unsigned c = 0; c < m_chains.size(); ++c)
+        {
+            const std::vector<Moments>& batches = m_chains[c].batches[d];
+            unsigned a = batches.size();
+
+            Moments total;
+
+            for (unsigned i = 0; i < a; ++i)
+                total.merge(batches[i]);
+
+            double varBM = 0.0;
+
+            for (unsigned i = 0; i < a; ++i)
+                varBM += (batches[i].mean - total.mean) * (batches[i].mean - total.mean);
+
+            varBM /= (a - 1);
+
+            double n = total.count;
+            double s2 = total.m2 / (n - 1);
+            double sigma2 = m_chains[c].batchSize * varBM;
+
+            // a constant parameter carries no autocorrelation
+            if (sigma2 <= 0.0 || s2 <= 0.0)
+                ess += n;
+            else
+                ess += std::min(n, n * s2 / sigma2);
+        }
+
+        return ess;
+    }
+
+    double minEss() const
+    {
+        double minimum = ess(0);
+
+        for (unsigned d = 1; d < m_dimension; ++d)
+            minimum = std::min(minimum, ess(d));
+
+        return minimum;
+    }
+
+    double rhat(unsigned d) const
+    {
+        if (!isReady())
+            return HUGE_VAL;
+
+        std::vector<Moments> sequences;
+
+        for (unsigned c = 0; c < m_chains.size(); ++c)
+        {
+            const std::vector<Moments>& batches = m_chains[c].batches[d];
+            unsigned half = batches.size() / 2;
+
+            Moments first, second;
+
+            for (unsigned i = 0; i < half; ++i)
+            {
+                first.merge(batches[i]);
+                second.merge(batches[half + i]);
+            }
+
+            sequences.push_back(first);
+            sequences.push_back(second);
+        }
+
+        unsigned m = sequences.size();
+        double n = 0.0;
+        Moments means;
+        double W = 0.0;
+
+        for (unsigned i = 0; i < m; ++i)
+        {
+            n += sequences[i].count;
+            means.add(sequences[i].mean);
+            W += sequences[i].m2 / (sequences[i].count - 1);
+        }
+
+        n /= m;
+        W /= m;
+
+        double B = n * means.m2 / (m - 1);
+
+        if (W <= 0.0)
+            return 1.0;
+
+        double varPlus = (n - 1) / n * W + B / n;
+
+        return sqrt(varPlus / W);
+    }
+
+    double maxRhat() const
+    {
+        double maximum = rhat(0);
+
+        for (unsigned d = 1; d < m_dimension; ++d)
+            maximum = std::max(maximum, rhat(d));
+
+        return maximum;
+    }
+
+    struct Moments
+    {
+        Moments() : count(0), mean(0.0), m2(0.0) {}
+
+        void add(double v)
+        {
+            ++count;
+            double delta = v - mean;
+            mean += delta / count;
+            m2 += delta * (v - mean);
+        }
+
+        void merge(const Moments& other)
+        {
+            if (other.count == 0)
+                return;
+
+            double n = static_cast<double>(count) + other.count;
+            double delta = other.mean - mean;
+
+            mean += delta * other.count / n;
+            m2 += other.m2 + delta * delta * count * other.count / n;
+            count += other.count;
+        }
+
+        uint64_t count;
+        double mean;
+        double m2;
+    };
+
+    struct Chain
+    {
+        uint64_t batchSize;
+        uint64_t numOfSamples;
+        std::vector< std::vector<Moments> > batches;    // [parameter][batch]
+        std::vector<Moments> current;                   // [parameter]
+    };
+
+    // MIN_NUM_OF_BATCHES batches at least as long as they are many, i.e.
+    // >= sqrt(samples in batches), and minNumOfSamples samples
+    bool isReady(const Chain& c) const
+    {
+        uint64_t a = c.batches[0].size();
+
+        return a >= MIN_NUM_OF_BATCHES && c.batchSize >= a && c.numOfSamples >= m_minNumOfSamples;
+    }
+
+    bool isReady() const
+    {
+        for (unsigned c = 0; c < m_chains.size(); ++c)
+        {
+            if (!isReady(m_chains[c]))
+                return false;
+        }
+
+        return true;
+    }
+
+    unsigned m_dimension;
+    unsigned m_numOfBatches;
+    uint64_t m_minNumOfSamples;
+    std::vector<Chain> m_chains;
+
+    mutable pthread_mutex_t m_mutex;
+};
+
+
+#endif // CONVERGENCE_MONITOR_H_
@@ -0,0 +1,577 @@
+#ifndef LIKELIHOOD_H_
+#define LIKELIHOOD_H_
+
+#include <cstdio>
+#include <cmath>
+#include <vector>
+
+#include "bayesbox/Bayes.h"
+#include "bayesbox/PackedDataSet.h"
+#include "bayesbox/RandomGenerator.h"
+#include "common/verify.h"
+
+
+// Expression templates (namespace likelihood) for declaring energies
+// (negative log densities) of 1-D data:
+//
+//     using namespace likelihood;
+//
+//     mixture(2, 3, datum(), param(0), param(1), constant(1.0))    // data term
+//     rangePenalty(param(0), 0.0, 1.0, 10000.0)
+//         + (square(param(1)) + square(param(4))) / 50.0            // prior
+//
+// datum() is the y of a datum and param(k) entry k of the parameter vector.
+// Before a pass over the data every expression is bound to the parameter
+// vector: whatever does not depend on the datum is folded into a constant
+// once, so the data loop of Likelihood is a single inlined loop over y with
+// no temporaries, and a Gaussian data term without a mixture is plain
+// arithmetic the compiler can vectorize.
+//
+// Every node has isDataDependent, a Bound type and bind(theta); bound
+// nodes evaluate with operator()(y).
+//
+// The normal densities are normalized with pi, whereas MixtureParameter
+// uses 3.14: the data term of the mixture above differs from
+// MixtureParameter::energy() by N log(sqrt(2 pi) / sqrt(2 * 3.14)).
+
+namespace likelihood
+{
+
+template <typename E> class LikelihoodExpr
+{
+public:
+    const E& self() const { return static_cast<const E&>(*this); }
+};
+
+
+// a bound node which does not depend on the datum becomes a constant
+template <bool isDataDependent, typename Node> struct LikelihoodFold;
+
+class ConstantExpr : public LikelihoodExpr<ConstantExpr>
+{
+public:
+    static const bool isDataDependent = false;
+    typedef ConstantExpr Bound;
+
+    explicit ConstantExpr(double value) : m_value(value) {}
+
+    Bound bind(const double* /* theta */) const { return *this; }
+    double operator()(double /* y */) const { return m_value; }
+
+private:
+    double m_value;
+};
+
+template <typename Node> struct LikelihoodFold<true, Node>
+{
+    typedef Node Type;
+    static Type make(const Node& node) { return node; }
+};
+
+template <typename Node> struct LikelihoodFold<false, Node>
+{
+    typedef ConstantExpr Type;
+    static Type make(const Node& node) { return ConstantExpr(node(0.0)); }
+};
+
+
+class DatumExpr : public LikelihoodExpr<DatumExpr>
+{
+public:
+    static const bool isDataDependent = true;
+    typedef DatumExpr Bound;
+
+    Bound bind(const double* /* theta */) const { return *this; }
+    double operator()(double y) const { return y; }
+};
+
+
+class ParamExpr : public LikelihoodExpr<ParamExpr>
+{
+public:
+    static const bool isDataDependent = false;
+    typedef ConstantExpr Bound;
+
+    explicit ParamExpr(unsigned index) : m_index(index) {}
+
+    Bound bind(const double* theta) const { return ConstantExpr(theta[m_index]); }
+
+private:
+    unsigned m_index;
+};
+
+
+struct AddOp { static double apply(double a, double b) { return a + b; } };
+struct SubtractOp { static double apply(double a, double b) { return a - b; } };
+struct MultiplyOp { static double apply(double a, double b) { return a * b; } };
+struct DivideOp { static double apply(double a, double b) { return a / b; } };
+
+struct NegateOp { static double apply(double a) { return -a; } };
+struct SquareOp { static double apply(double a) { return a * a; } };
+struct ExpOp { static double apply(double a) { return ::exp(a); } };
+struct LogOp { static double apply(double a) { return ::log(a); } };
+
+
+template <typename L, typename R, typename Op> class BinaryExpr : public LikelihoodExpr< BinaryExpr<L, R, Op> >
+{
+public:
+    static const bool isDataDependent = L::isDataDependent || R::isDataDependent;
+    typedef BinaryExpr<typename L::Bound, typename R::Bound, Op> Unfolded;
+    typedef typename LikelihoodFold<isDataDependent, Unfolded>::Type Bound;
+
+    BinaryExpr(const L& l, const R& r) : m_l(l), m_r(r) {}
+
+    Bound bind(const double* theta) const
+    {
+        return LikelihoodFold<isDataDependent, Unfolded>::make(Unfolded(m_l.bind(theta), m_r.bind(theta)));
+    }
+
+    double operator()(double y) const { return Op::apply(m_l(y), m_r(y)); }
+
+private:
+    L m_l;
+    R m_r;
+};
+
+
+template <typename E, typename Op> class UnaryExpr : public LikelihoodExpr< UnaryExpr<E, Op> >
+{
+public:
+    static const bool isDataDependent = E::isDataDependent;
+    typedef UnaryExpr<typename E::Bound, Op> Unfolded;
+    typedef typename LikelihoodFold<isDataDependent, Unfolded>::Type Bound;
+
+    explicit UnaryExpr(const E& e) : m_e(e) {}
+
+    Bound bind(const double* theta) const
+    {
+        return LikelihoodFold<isDataDependent, Unfolded>::make(Unfolded(m_e.bind(theta)));
+    }
+
+    double operator()(double y) const { return Op::apply(m_e(y)); }
+
+private:
+    E m_e;
+};
+
+
+// -log N(x | mean, sigma); with a sigma independent of the datum its
+// reciprocal and logarithm are computed once per bind
+template <typename X, typename M, typename S> class GaussianBound
+{
+public:
+    static const bool isDataDependent = X::isDataDependent || M::isDataDependent || S::isDataDependent;
+    typedef GaussianBound Bound;
+
+    GaussianBound(const X& x, const M& mean, const S& sigma) : m_x(x), m_mean(mean), m_sigma(sigma) {}
+
+    double operator()(double y) const
+    {
+        double sigma = m_sigma(y);
+        double r = (m_x(y) - m_mean(y)) / sigma;
+
+        return 0.5 * r * r + ::log(sigma) + 0.5 * ::log(2.0 * M_PI);
+    }
+
+private:
+    X m_x;
+    M m_mean;
+    S m_sigma;
+};
+
+template <typename X, typename M> class GaussianBound<X, M, ConstantExpr>
+{
+public:
+    static const bool isDataDependent = X::isDataDependent || M::isDataDependent;
+    typedef GaussianBound Bound;
+
+    GaussianBound(const X& x, const M& mean, const ConstantExpr& sigma)
+        : m_x(x), m_mean(mean), m_inverse(1.0 / sigma(0.0)), m_offset(::log(sigma(0.0)) + 0.5 * ::log(2.0 * M_PI)) {}
+
+    double operator()(double y) const
+    {
+        double r = (m_x(y) - m_mean(y)) * m_inverse;
+
+        return 0.5 * r * r + m_offset;
+    }
+
+private:
+    X m_x;
+    M m_mean;
+    double m_inverse;
+    double m_offset;
+};
+
+template <typename X, typename M, typename S> class GaussianExpr : public LikelihoodExpr< GaussianExpr<X, M, S> >
+{
+public:
+    static const bool isDataDependent = X::isDataDependent || M::isDataDependent || S::isDataDependent;
+    typedef GaussianBound<typename X::Bound, typename M::Bound, typename S::Bound> Unfolded;
+    typedef typename LikelihoodFold<isDataDependent, Unfolded>::Type Bound;
+
+    GaussianExpr(const X& x, const M& mean, const S& sigma) : m_x(x), m_mean(mean), m_sigma(sigma) {}
+
+    Bound bind(const double* theta) const
+    {
+        return LikelihoodFold<isDataDependent, Unfolded>::make(
+            Unfolded(m_x.bind(theta), m_mean.bind(theta), m_sigma.bind(theta)));
+    }
+
+private:
+    X m_x;
+    M m_mean;
+    S m_sigma;
+};
+
+
+// -log sum_j w_j N(x | mean_j, sigma_j), in fixed storage so that binding
+// (once per energy()) does not allocate
+template <typename X> class MixtureBound
+{
+public:
+    static const bool isDataDependent = X::isDataDependent;
+    typedef MixtureBound Bound;
+
+    static const unsigned MAX_NUM_OF_COMPONENTS = 64;
+
+    MixtureBound(const X& x, unsigned numOfComponents) : m_x(x), m_numOfComponents(numOfComponents)
+    {
+        VERIFY("too many mixture components" && numOfComponents <= MAX_NUM_OF_COMPONENTS);
+    }
+
+    void setComponent(unsigned j, double weight, double mean, double sigma)
+    {
+        m_scale[j] = weight / (sigma * sqrt(2.0 * M_PI));
+        m_exponent[j] = -0.5 / (sigma * sigma);
+        m_mean[j] = mean;
+    }
+
+    double operator()(double y) const
+    {
+        double x = m_x(y);
+        double sum = 0.0;
+
+        for (unsigned j = 0; j < m_numOfComponents; ++j)
+        {
+            double r = x - m_mean[j];
+            sum += m_scale[j] * ::exp(m_exponent[j] * r * r);
+        }
+
+        return -::log(sum);
+    }
+
+private:
+    X m_x;
+    unsigned m_numOfComponents;
+    double m_scale[MAX_NUM_OF_COMPONENTS];
+    double m_exponent[MAX_NUM_OF_COMPONENTS];
+    double m_mean[MAX_NUM_OF_COMPONENTS];
+};
+
+// The weight, mean and sigma of component j are bound to theta + j * stride,
+// so inside them param(k) is entry k of the component.
+template <typename X, typename W, typename M, typename S> class MixtureExpr : public LikelihoodExpr< MixtureExpr<X, W, M, S> >
+{
+public:
+    static const bool isDataDependent = X::isDataDependent;
+    typedef MixtureBound<typename X::Bound> Unfolded;
+    typedef typename LikelihoodFold<isDataDependent, Unfolded>::Type Bound;
+
+    MixtureExpr(unsigned numOfComponents, unsigned stride, const X& x, const W& weight, const M& mean, const S& sigma)
+        : m_numOfComponents(numOfComponents), m_stride(stride), m_x(x), m_weight(weight), m_mean(mean), m_sigma(sigma)
+    {
+        VERIFY(numOfComponents > 0 && numOfComponents <= Unfolded::MAX_NUM_OF_COMPONENTS);
+    }
+
+    Bound bind(const double* theta) const
+    {
+        Unfolded bound(m_x.bind(theta), m_numOfComponents);
+
+        for (unsigned j = 0; j < m_numOfComponents; ++j)
+        {
+            const double* component = theta + j * m_stride;
+
+            bound.setComponent(j, m_weight.bind(component)(0.0), m_mean.bind(component)(0.0), m_sigma.bind(component)(0.0));
+        }
+
+        return LikelihoodFold<isDataDependent, Unfolded>::make(bound);
+    }
+
+private:
+    // the components must not depend on the datum
+    typedef char IsComponentConstant[(W::isDataDependent || M::isDataDependent || S::isDataDependent) ? -1 : 1];
+
+    unsigned m_numOfComponents;
+    unsigned m_stride;
+    X m_x;
+    W m_weight;
+    M m_mean;
+    S m_sigma;
+};
+
+
+// scale * (distance of e outside [lo, hi])^2, like MixtureParameter::prior()
+template <typename E> class RangePenaltyExpr : public LikelihoodExpr< RangePenaltyExpr<E> >
+{
+public:
+    static const bool isDataDependent = E::isDataDependent;
+    typedef RangePenaltyExpr<typename E::Bound> Unfolded;
+    typedef typename LikelihoodFold<isDataDependent, Unfolded>::Type Bound;
+
+    RangePenaltyExpr(const E& e, double lo, double hi, double scale) : m_e(e), m_lo(lo), m_hi(hi), m_scale(scale)
+    {
+        VERIFY(lo <= hi);
+    }
+
+    Bound bind(const double* theta) const
+    {
+        return LikelihoodFold<isDataDependent, Unfolded>::make(Unfolded(m_e.bind(theta), m_lo, m_hi, m_scale));
+    }
+
+    double operator()(double y) const
+    {
+        double v = m_e(y);
+        double d = (v < m_lo) ? m_lo - v : ((v > m_hi) ? v - m_hi : 0.0);
+
+        return m_scale * d * d;
+    }
+
+private:
+    E m_e;
+    double m_lo;
+    double m_hi;
+    double m_scale;
+};
+
+
+inline DatumExpr datum() { return DatumExpr(); }
+inline ParamExpr param(unsigned index) { return ParamExpr(index); }
+inline ConstantExpr constant(double value) { return ConstantExpr(value); }
+
+#define LIKELIHOOD_BINARY_OPERATOR(op, Op)                                                                  \
+    template <typename L, typename R>                                                                       \
+    BinaryExpr<L, R, Op> operator op(const LikelihoodExpr<L>& l, const LikelihoodExpr<R>& r)                 \
+    {                                                                                                       \
+        return BinaryExpr<L, R, Op>(l.self(), r.self());                                                    \
+    }                                                                                                       \
+    template <typename L> BinaryExpr<L, ConstantExpr, Op> operator op(const LikelihoodExpr<L>& l, double r)  \
+    {                                                                                                       \
+        return BinaryExpr<L, ConstantExpr, Op>(l.self(), ConstantExpr(r));                                  \
+    }                                                                                                       \
+    template <typename R> BinaryExpr<ConstantExpr, R, Op> operator op(double l, const LikelihoodExpr<R>& r)  \
+    {                                                                                                       \
+        return BinaryExpr<ConstantExpr, R, Op>(ConstantExpr(l), r.self());                                  \
+    }
+
+LIKELIHOOD_BINARY_OPERATOR(+, AddOp)
+LIKELIHOOD_BINARY_OPERATOR(-, SubtractOp)
+LIKELIHOOD_BINARY_OPERATOR(*, MultiplyOp)
+LIKELIHOOD_BINARY_OPERATOR(/, DivideOp)
+
+#undef LIKELIHOOD_BINARY_OPERATOR
+
+template <typename E> UnaryExpr<E, NegateOp> operator-(const LikelihoodExpr<E>& e) { return UnaryExpr<E, NegateOp>(e.self()); }
+template <typename E> UnaryExpr<E, SquareOp> square(const LikelihoodExpr<E>& e) { return UnaryExpr<E, SquareOp>(e.self()); }
+template <typename E> UnaryExpr<E, ExpOp> exp(const LikelihoodExpr<E>& e) { return UnaryExpr<E, ExpOp>(e.self()); }
+template <typename E> UnaryExpr<E, LogOp> log(const LikelihoodExpr<E>& e) { return UnaryExpr<E, LogOp>(e.self()); }
+
+template <typename X, typename M, typename S>
+GaussianExpr<X, M, S> gaussian(const LikelihoodExpr<X>& x, const LikelihoodExpr<M>& mean, const LikelihoodExpr<S>& sigma)
+{
+    return GaussianExpr<X, M, S>(x.self(), mean.self(), sigma.self());
+}
+
+template <typename X, typename W, typename M, typename S>
+MixtureExpr<X, W, M, S> mixture(unsigned numOfComponents, unsigned stride, const LikelihoodExpr<X>& x,
+                                const LikelihoodExpr<W>& weight, const LikelihoodExpr<M>& mean, const LikelihoodExpr<S>& sigma)
+{
+    return MixtureExpr<X, W, M, S>(numOfComponents, stride, x.self(), weight.self(), mean.self(), sigma.self());
+}
+
+template <typename E> RangePenaltyExpr<E> rangePenalty(const LikelihoodExpr<E>& e, double lo, double hi, double scale)
+{
+    return RangePenaltyExpr<E>(e.self(), lo, hi, scale);
+}
+
+} // namespace likelihood
+
+
+// A data term (summed over the data) and a prior (evaluated once) as the
+// energy prior + temperature * h of IMCMCParameter::energy().
+template <typename D, typename P> class Likelihood
+{
+public:
+    Likelihood(const D& data, const P& prior) : m_data(data), m_prior(prior) {}
+
+    double prior(const double* theta) const { return m_prior.bind(theta)(0.0); }
+
+    // over contiguous y of any element type (e.g. PackedDataSet<float>),
+    // accumulated in double
+    template <typename T> double dataTerm(const T* pY, unsigned num, const double* theta) const
+    {
+        typename D::Bound term = m_data.bind(theta);
+        double sum = 0.0;
+
+        for (unsigned i = 0; i < num; ++i)
+            sum += term(pY[i]);
+
+        return sum;
+    }
+
+    double dataTerm(const std::vector<Data>& dataSet, const double* theta) const
+    {
+        typename D::Bound term = m_data.bind(theta);
+        double sum = 0.0;
+
+        for (unsigned i = 0; i < dataSet.size(); ++i)
+            sum += term(dataSet[i].y(0));
+
+        return sum;
+    }
+
+private:
+    typedef char IsPriorConstant[P::isDataDependent ? -1 : 1];
+
+    D m_data;
+    P m_prior;
+};
+
+template <typename D, typename P>
+Likelihood<D, P> makeLikelihood(const likelihood::LikelihoodExpr<D>& data, const likelihood::LikelihoodExpr<P>& prior)
+{
+    return Likelihood<D, P>(data.self(), prior.self());
+}
+
+
+// IMCMCParameter over a parameter vector with a Likelihood as energy.
+// next() moves one entry at a time, cycling through those with a non-zero
+// step, uniformly within +-step.  As MixtureParameter it has no regression
+// function: value(x) is x.
+template <typename D, typename P> class LikelihoodParameter : public IMCMCParameter
+{
+public:
+    LikelihoodParameter(const Likelihood<D, P>& likelihood, const std::vector<double>& theta, const std::vector<double>& step)
+        : m_likelihood(likelihood), m_theta(theta), m_step(step), m_pPackedDataSet(0), m_pPackedDoubleDataSet(0),
+          m_pRng(0), m_temperature(1.0), m_index(0), m_previous(0.0)
+    {
+        VERIFY(!theta.empty() && theta.size() == step.size());
+
+        for (unsigned k = 0; k < step.size(); ++k)
+        {
+            if (step[k] != 0.0)
+                m_moves.push_back(k);
+        }
+
+        VERIFY("no parameter to move" && !m_moves.empty());
+    }
+
+    // Opt-in: the data term runs over the contiguous y of packedDataSet
+    // (which must hold the data passed to energy()) instead of the ublas
+    // vectors of the data set, in float32 or double.
+    void setPackedDataSet(const PackedDataSet<float>& packedDataSet)
+    {
+        m_pPackedDataSet = &packedDataSet;
+        m_pPackedDoubleDataSet = 0;
+    }
+
+    void setPackedDataSet(const PackedDataSet<double>& packedDataSet)
+    {
+        m_pPackedDataSet = 0;
+        m_pPackedDoubleDataSet = &packedDataSet;
+    }
+
+    void resetPackedDataSet()
+    {
+        m_pPackedDataSet = 0;
+        m_pPackedDoubleDataSet = 0;
+    }
+
+    ublas::vector<double> value(const ublas::vector<double>& x) const { return x; }
+
+    void getValues(std::vector<double>& values) const { values = m_theta; }
+
+    void setValues(const std::vector<double>& values)
+    {
+        VERIFY(values.size() == m_theta.size());
+        m_theta = values;
+    }
+
+    void print(FILE* fp)
+    {
+        for (unsigned k = 0; k < m_theta.size(); ++k)
+            fprintf(fp, "%f  ", m_theta[k]);
+
+        fprintf(fp, "\n");
+    }
+
+    double energy(std::vector<Data>& dataSet, double& h)
+    {
+        if (m_pPackedDataSet)
+            h = packedDataTerm(*m_pPackedDataSet, dataSet);
+        else if (m_pPackedDoubleDataSet)
+            h = packedDataTerm(*m_pPackedDoubleDataSet, dataSet);
+        else
+            h = m_likelihood.dataTerm(dataSet, &m_theta[0]);
+
+        return m_likelihood.prior(&m_theta[0]) + m_temperature * h;
+    }
+
+    void next(unsigned i)
+    {
+        m_index = m_moves[i % m_moves.size()];
+        m_previous = m_theta[m_index];
+        m_theta[m_index] += (m_pRng->uniform() * 2.0 - 1.0) * m_step[m_index];
+    }
+
+    void accept()
+    {
+        // nothing to do
+    }
+
+    void reject()
+    {
+        m_theta[m_index] = m_previous;
+    }
+
+    void push(std::vector<IMCMCParameter*>& paramSet)
+    {
+        paramSet.push_back(new LikelihoodParameter(*this));
+    }
+
+    double getTemperature() { return m_temperature; }
+    void setTemperature(double temperature) { m_temperature = temperature; }
+    void setRng(RandomGenerator& rng) { m_pRng = &rng; }
+
+    void swap(IMCMCParameter* pParam)
+    {
+        LikelihoodParameter* pDst = dynamic_cast<LikelihoodParameter*>(pParam);
+        VERIFY(pDst != 0);
+
+        m_theta.swap(pDst->m_theta);
+    }
+
+private:
+    template <typename T> double packedDataTerm(const PackedDataSet<T>& packedDataSet, const std::vector<Data>& dataSet) const
+    {
+        VERIFY(packedDataSet.size() == dataSet.size() && (packedDataSet.size() == 0 || packedDataSet.getDimension() == 1));
+
+        return m_likelihood.dataTerm(packedDataSet.getY(), packedDataSet.size(), &m_theta[0]);
+    }
+
+    Likelihood<D, P> m_likelihood;
+    std::vector<double> m_theta;
+    std::vector<double> m_step;
+    std::vector<unsigned> m_moves;
+
+    const PackedDataSet<float>* m_pPackedDataSet;
+    const PackedDataSet<double>* m_pPackedDoubleDataSet;
+
+    RandomGenerator* m_pRng;
+    double m_temperature;
+
+    unsigned m_index;
+    double m_previous;
+};
+
+
+#endif // LIKELIHOOD_H_
@@ -7,6 +7,7 @@
 #include <cassert>
 #include <stdint.h>
 #include <vector>
+#include <algorithm>
 
 #include <boost/numeric/ublas/vector.hpp>
 #include <boost/numeric/ublas/matrix.hpp>
@@ -14,6 +15,8 @@
 
 #include "bayesbox/RandomGenerator.h"
 #include "bayesbox/Bayes.h"
+#include "bayesbox/PackedDataSet.h"
+#include "bayesbox/BinnedDataSet.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,6 +25,7 @@
 #include <assert.h>     // assert()
 
 #include "common/verify.h"
+#include "common/ThreadPool.h"
 
 using namespace boost::numeric;
 
@@ -29,7 +33,8 @@ using namespace boost::numeric;
 class MixtureParameter : public IMCMCParameter
 {
 public:
-    MixtureParameter() : m_pRng(0), m_temperature(1.0) {}
+    MixtureParameter() : m_pRng(0), m_temperature(1.0), m_pThreadPool(0), m_shardSize(4096), m_pPackedDataSet(0),
+                           m_pBinnedDataSet(0), m_pSurrogateDataSet(0), m_pruningTolerance(0.0) {}
 
     ~MixtureParameter() {}
 
@@ -38,6 +43,11 @@ public:
         return x;
     }
 
+    void value(const ublas::vector<double>& x, ublas::vector<double>& y) const
+    {
+        y = x;
+    }
+
     void setParameter(ublas::matrix<double>& w1)
     {
         m_w1 = w1;
@@ -52,6 +62,55 @@ public:
 
     void setRng(RandomGenerator& rng) { m_pRng = &rng; }
 
+    // Opt-in: split the data loop of energy() into shards of shardSize data
+    // evaluated on the pool.  The partial sums are added in shard order, so
+    // the result does not depend on the number of threads.
+    void setThreadPool(ThreadPool& pool, unsigned shardSize = 4096)
+    {
+        VERIFY(shardSize > 0);
+
+        m_pThreadPool = &pool;
+        m_shardSize = shardSize;
+    }
+
+    // Opt-in mixed precision: the data term is evaluated in float32 over
+    // packedDataSet (which must hold the same data passed to energy()) and
+    // accumulated in double.  Not together with setBinnedDataSet().
+    void setPackedDataSet(const PackedDataSet<float>& packedDataSet)
+    {
+        VERIFY("packed and binned data sets are exclusive" && !m_pBinnedDataSet);
+        m_pPackedDataSet = &packedDataSet;
+    }
+    void resetPackedDataSet() { m_pPackedDataSet = 0; }
+
+    // Opt-in: the data term is evaluated over the weighted bins of
+    // binnedDataSet (built from the data passed to energy()) instead of the
+    // raw data; see binningError() and binningErrorBound().  Not together
+    // with setPackedDataSet().
+    void setBinnedDataSet(const BinnedDataSet& binnedDataSet)
+    {
+        VERIFY("packed and binned data sets are exclusive" && !m_pPackedDataSet);
+        m_pBinnedDataSet = &binnedDataSet;
+    }
+    void resetBinnedDataSet() { m_pBinnedDataSet = 0; }
+
+    // Surrogate for delayed acceptance (Model::setDelayedAcceptance()): the
+    // data term over the bins of surrogateDataSet, typically a coarse
+    // binning of the data passed to energy().
+    void setSurrogateDataSet(const BinnedDataSet& surrogateDataSet) { m_pSurrogateDataSet = &surrogateDataSet; }
+    void resetSurrogateDataSet() { m_pSurrogateDataSet = 0; }
+
+    // Opt-in: the binned data term (setBinnedDataSet(), setSurrogateDataSet())
+    // skips components which are negligible over a block of bins, see
+    // partialEnergyPruned().  The bins are sorted, so with binWidth = 0 the
+    // BinnedDataSet is an exact sorted index of the raw data.  0 turns it
+    // off.
+    void setPruningTolerance(double tolerance)
+    {
+        VERIFY(tolerance >= 0.0 && tolerance < 1.0);
+        m_pruningTolerance = tolerance;
+    }
+
     double getTemperature() { return m_temperature; }
 
     ublas::vector<double> createData()
@@ -64,6 +123,74 @@ public:
 
         return m_pRng->gaussian(mu, sigma, (double)1.0, (double)0.0);
     }
+
+    // Draws num data from the whole mixture (weight m_w1(j, 0), mean
+    // m_w1(j, 1), standard deviation m_w1(j, 2)) into pOut.  Every chunk of
+    // GENERATOR_CHUNK_SIZE data has its own generator seeded from (seed,
+    // chunk), so the output depends on seed only, not on the pool.
+    void createData(double* pOut, uint64_t num, unsigned seed, ThreadPool* pPool = 0) const
+    {
+        GeneratorTask task(*this, pOut, 0, num, seed);
+        unsigned numOfChunks = (num + GENERATOR_CHUNK_SIZE - 1) / GENERATOR_CHUNK_SIZE;
+
+        if (pPool)
+        {
+            pPool->parallelFor(numOfChunks, task);
+        }
+        else
+        {
+            for (unsigned i = 0; i < numOfChunks; ++i)
+                task.run(i);
+        }
+    }
+
+    // same data as above, written to fp as raw doubles in batches
+    void createData(FILE* fp, uint64_t num, unsigned seed, ThreadPool* pPool = 0) const
+    {
+        VERIFY(fp != 0);
+
+        uint64_t batchSize = static_cast<uint64_t>(pPool ? pPool->getNumOfThreads() : 1) * GENERATOR_CHUNK_SIZE;
+        std::vector<double> buffer(std::min(batchSize, num));
+
+        for (uint64_t first = 0; first < num; first += batchSize)
+        {
+            uint64_t n = std::min(batchSize, num - first);
+            GeneratorTask task(*this, &buffer[0], first, n, seed);
+            unsigned numOfChunks = (n + GENERATOR_CHUNK_SIZE - 1) / GENERATOR_CHUNK_SIZE;
+
+            if (pPool)
+            {
+                pPool->parallelFor(numOfChunks, task);
+            }
+            else
+            {
+                for (unsigned i = 0; i < numOfChunks; ++i)
+                    task.run(i);
+            }
+
+            VERIFY(fwrite(&buffer[0], sizeof(double), n, fp) == n);
+        }
+    }
+
+    // The data of createData() as y.  The mixture is a density of y without
+    // a regressor, so x is a zero vector of the same shape; value(x) is then
+    // 0 and Model::WAIC() scores y itself rather than a zero residual.
+    void createDataSet(std::vector<Data>& dataSet, unsigned num, unsigned seed, ThreadPool* pPool = 0) const
+    {
+        std::vector<double> y(num);
+
+        if (num > 0)
+            createData(&y[0], num, seed, pPool);
+
+        dataSet.resize(num);
+
+        for (unsigned i = 0; i < num; ++i)
+        {
+            dataSet[i].x = ublas::zero_vector<double>(1);
+            dataSet[i].y.resize(1);
+            dataSet[i].y(0) = y[i];
+        }
+    }
     
     double prior()
     {
@@ -80,39 +207,398 @@ public:
 
     double energy(std::vector<Data>& dataSet, double& h)
     {
+        if (m_pThreadPool)
+            h = shardedEnergy(dataSet);
+        else
+            h = partialEnergy(dataSet, 0, numOfTerms(dataSet));
+
+//        printf("e = %f\n", prior() + m_temperature * h);
+        return prior() + m_temperature * h;
+    }
+
+    double surrogateEnergy(std::vector<Data>& dataSet, double& h)
+    {
+        if (!m_pSurrogateDataSet)
+            return energy(dataSet, h);
+
+        VERIFY(m_pSurrogateDataSet->getNumOfData() == dataSet.size());
+
+        h = partialEnergyBinned(*m_pSurrogateDataSet, 0, m_pSurrogateDataSet->size());
+
+        return prior() + m_temperature * h;
+    }
+
+    bool hasSurrogate() const { return m_pSurrogateDataSet != 0; }
+
+    // number of data, or of bins in binned mode
+    unsigned numOfTerms(const std::vector<Data>& dataSet) const
+    {
+        if (m_pBinnedDataSet)
+        {
+            VERIFY(m_pBinnedDataSet->getNumOfData() == dataSet.size());
+            return m_pBinnedDataSet->size();
+        }
+
+        return dataSet.size();
+    }
+
+    double partialEnergy(const std::vector<Data>& dataSet, unsigned begin, unsigned end) const
+    {
+        if (m_pBinnedDataSet)
+            return partialEnergyBinned(*m_pBinnedDataSet, begin, end);
+
+        if (m_pPackedDataSet)
+        {
+            VERIFY(m_pPackedDataSet->size() == dataSet.size());
+            return partialEnergyFloat(begin, end);
+        }
+
         double sum1 = 0.0;
         
-        for (unsigned i = 0; i < dataSet.size(); ++i)
+        for (unsigned i = begin; i < end; ++i)
         {
             double sum2 = 0.0;
+            double y = dataSet[i].y(0);
 
             for (unsigned j = 0; j < m_w1.size1(); ++j)
             {
-//                 printf("0 alpha = %f\n", m_w1(0, 0));
-//                 printf("0 mu = %f\n", m_w1(0, 1));
-//                 printf("0 sigma = %f\n", m_w1(0, 2));
+                double r = y - m_w1(j, 1);
+                sum2 += m_w1(j, 0) * exp(- r * r / 2.0);
+            }
+
+            sum1 += -log(sum2 / sqrt(2 * 3.14));
+        }
+
+        return sum1;
+    }
+
+    double partialEnergyFloat(unsigned begin, unsigned end) const
+    {
+        static const unsigned blockSize = 256;
+
+        VERIFY(m_pPackedDataSet->getDimension() == 1);
+
+        unsigned numOfComponents = m_w1.size1();
+        std::vector<float> alpha(numOfComponents);
+        std::vector<float> mu(numOfComponents);
+
+        for (unsigned j = 0; j < numOfComponents; ++j)
+        {
+            alpha[j] = static_cast<float>(m_w1(j, 0));
+            mu[j] = static_cast<float>(m_w1(j, 1));
+        }
+
+        const float* pY = m_pPackedDataSet->getY();
+        const float scale = static_cast<float>(1.0 / sqrt(2 * 3.14));
+        float sum2[blockSize];
+        PairwiseSum sum1;
 
-//                 printf("1 alpha = %f\n", m_w1(1, 0));
-//                 printf("1 mu = %f\n", m_w1(1, 1));
-//                 printf("1 sigma = %f\n", m_w1(1, 2));
+        for (unsigned b = begin; b < end; b += blockSize)
+        {
+            unsigned n = std::min(blockSize, end - b);
+            const float* y = pY + b;
 
-                ublas::vector<double> mu(1);
-                mu(0) = m_w1(j, 1);
+            for (unsigned i = 0; i < n; ++i)
+                sum2[i] = 0.0f;
 
-                ublas::vector<double> r = dataSet[i].y - mu;
-                sum2 += m_w1(j, 0) * exp(- inner_prod(r, r) / 2.0);
+            // component-outer so that the inner loop is a straight float32
+            // SIMD loop over the data
+            for (unsigned j = 0; j < numOfComponents; ++j)
+            {
+                float a = alpha[j];
+                float m = mu[j];
+
+                for (unsigned i = 0; i < n; ++i)
+                {
+                    float r = y[i] - m;
+                    sum2[i] += a * expf(-0.5f * r * r);
+                }
             }
 
-            sum1 += -log(sum2 / sqrt(2 * 3.14));
+            double blockSum = 0.0;
+
+            for (unsigned i = 0; i < n; ++i)
+                blockSum += -logf(sum2[i] * scale);
 
-//            printf("sum1 = %f\n", sum1);
-//          printf("sum2 = %f\n", sum2);
+            sum1.add(blockSum);
         }
 
-        h = sum1;
+        return sum1.sum();
+    }
 
-//        printf("e = %f\n", prior() + m_temperature * h);
-        return prior() + m_temperature * h;
+    // Validation harness for the mixed precision path: returns the relative
+    // difference of the data term against the double path on dataSet.  For
+    // well-conditioned data it stays in the order of FLT_EPSILON.
+    double mixedPrecisionError(std::vector<Data>& dataSet)
+    {
+        VERIFY(m_pPackedDataSet != 0);
+
+        const PackedDataSet<float>* pPackedDataSet = m_pPackedDataSet;
+        double hFloat = 0.0, hDouble = 0.0;
+
+        energy(dataSet, hFloat);
+        m_pPackedDataSet = 0;
+        energy(dataSet, hDouble);
+        m_pPackedDataSet = pPackedDataSet;
+
+        return fabs(hFloat - hDouble) / std::max(fabs(hDouble), 1.0);
+    }
+
+    double partialEnergyBinned(const BinnedDataSet& binnedDataSet, unsigned begin, unsigned end) const
+    {
+        if (m_pruningTolerance > 0.0)
+            return partialEnergyPruned(binnedDataSet, begin, end);
+
+        const double* pCenters = binnedDataSet.getCenters();
+        const double* pWeights = binnedDataSet.getWeights();
+        double sum1 = 0.0;
+
+        for (unsigned i = begin; i < end; ++i)
+        {
+            double sum2 = 0.0;
+
+            for (unsigned j = 0; j < m_w1.size1(); ++j)
+            {
+                double r = pCenters[i] - m_w1(j, 1);
+                sum2 += m_w1(j, 0) * exp(- r * r / 2.0);
+            }
+
+            sum1 += -pWeights[i] * log(sum2 / sqrt(2 * 3.14));
+        }
+
+        return sum1;
+    }
+
+    // Error estimate of the binned mode: absolute difference of the data
+    // term against the exact path on dataSet.
+    double binningError(std::vector<Data>& dataSet)
+    {
+        VERIFY(m_pBinnedDataSet != 0);
+
+        const BinnedDataSet* pBinnedDataSet = m_pBinnedDataSet;
+        double hBinned = 0.0, hExact = 0.0;
+
+        energy(dataSet, hBinned);
+        m_pBinnedDataSet = 0;
+        energy(dataSet, hExact);
+        m_pBinnedDataSet = pBinnedDataSet;
+
+        return fabs(hBinned - hExact);
+    }
+
+    // A priori bound of binningError() for the current parameter without
+    // touching the raw data.  For unit variance components the per-datum
+    // term f(y) has f'' = 1 - Var(mu | y), so |f''| <= max(1, d^2 / 4 - 1)
+    // with d the spread of the component means.
+    double binningErrorBound() const
+    {
+        VERIFY(m_pBinnedDataSet != 0);
+
+        double lo = m_w1(0, 1), hi = m_w1(0, 1);
+
+        for (unsigned j = 1; j < m_w1.size1(); ++j)
+        {
+            lo = std::min(lo, m_w1(j, 1));
+            hi = std::max(hi, m_w1(j, 1));
+        }
+
+        double curvature = std::max(1.0, (hi - lo) * (hi - lo) / 4.0 - 1.0);
+
+        return 0.5 * curvature * m_pBinnedDataSet->getWithinSumOfSquares();
+    }
+
+    // Every block of PRUNING_BLOCK_SIZE sorted bins spans [lo, hi], over
+    // which the density of component j lies between alpha_j exp(-D_j^2 / 2)
+    // and alpha_j exp(-d_j^2 / 2), d_j and D_j the nearest and the farthest
+    // distance of mu_j to [lo, hi].  Components whose upper bound is at most
+    // tolerance / K of the sum L of the lower bounds are skipped for the
+    // block.  The skipped mass is then below tolerance L and the kept one
+    // above (1 - tolerance) L, so every term grows by at most
+    // -log(1 - tolerance), see pruningErrorBound().  With a negative weight
+    // nothing is skipped.
+    double partialEnergyPruned(const BinnedDataSet& binnedDataSet, unsigned begin, unsigned end) const
+    {
+        const double* pCenters = binnedDataSet.getCenters();
+        const double* pWeights = binnedDataSet.getWeights();
+        unsigned numOfComponents = m_w1.size1();
+
+        std::vector<double> alpha(numOfComponents), mu(numOfComponents), upper(numOfComponents);
+        std::vector<unsigned> active(numOfComponents);
+        bool isBounded = true;
+
+        for (unsigned j = 0; j < numOfComponents; ++j)
+        {
+            alpha[j] = m_w1(j, 0);
+            mu[j] = m_w1(j, 1);
+            isBounded = isBounded && alpha[j] >= 0.0;
+        }
+
+        double sum1 = 0.0;
+
+        for (unsigned b = begin; b < end; b += PRUNING_BLOCK_SIZE)
+        {
+            unsigned blockEnd = std::min(b + PRUNING_BLOCK_SIZE, end);
+            double lo = pCenters[b], hi = pCenters[blockEnd - 1];
+            double lower = 0.0;
+
+            for (unsigned j = 0; j < numOfComponents; ++j)
+            {
+                double d = std::max(0.0, std::max(lo - mu[j], mu[j] - hi));
+                double D = std::max(mu[j] - lo, hi - mu[j]);
+
+                upper[j] = alpha[j] * exp(- d * d / 2.0);
+                lower += alpha[j] * exp(- D * D / 2.0);
+            }
+
+            double threshold = isBounded ? m_pruningTolerance * lower / numOfComponents : -1.0;
+            unsigned numOfActive = 0;
+
+            for (unsigned j = 0; j < numOfComponents; ++j)
+            {
+                if (upper[j] > threshold)
+                    active[numOfActive++] = j;
+            }
+
+            for (unsigned i = b; i < blockEnd; ++i)
+            {
+                double sum2 = 0.0;
+
+                for (unsigned n = 0; n < numOfActive; ++n)
+                {
+                    double r = pCenters[i] - mu[active[n]];
+                    sum2 += alpha[active[n]] * exp(- r * r / 2.0);
+                }
+
+                sum1 += -pWeights[i] * log(sum2 / sqrt(2 * 3.14));
+            }
+        }
+
+        return sum1;
+    }
+
+    // Error of pruning: the difference of the data term against the
+    // unpruned path on dataSet, never negative.
+    double pruningError(std::vector<Data>& dataSet)
+    {
+        VERIFY(m_pBinnedDataSet != 0);
+
+        double tolerance = m_pruningTolerance;
+        double hPruned = 0.0, hExact = 0.0;
+
+        energy(dataSet, hPruned);
+        m_pruningTolerance = 0.0;
+        energy(dataSet, hExact);
+        m_pruningTolerance = tolerance;
+
+        return hPruned - hExact;
+    }
+
+    // guaranteed bound of pruningError(), independent of the parameter
+    double pruningErrorBound() const
+    {
+        VERIFY(m_pBinnedDataSet != 0);
+
+        return -log(1.0 - m_pruningTolerance) * m_pBinnedDataSet->getNumOfData();
+    }
+
+    // Batched kernel of Model::MCMC() for many replicas: the data are split
+    // in shards of BATCH_SHARD_SIZE on pPool (without one, in shards of
+    // setThreadPool() on that pool, if any), and within a shard every datum
+    // is loaded once and applied to a tile of replicas whose parameters are
+    // laid out component-major, so the innermost loop runs over replicas.
+    bool energyBatch(std::vector<IMCMCParameter*>& replicaSet, const std::vector<unsigned>* pIndices,
+                     std::vector<Data>& dataSet, std::vector<double>& E, std::vector<double>& H, ThreadPool* pPool)
+    {
+        unsigned num = pIndices ? pIndices->size() : replicaSet.size();
+        std::vector<MixtureParameter*> params(num);
+
+        // only the double path, over the raw data or bins, without pruning
+        bool isSupported = !m_pPackedDataSet && m_pruningTolerance == 0.0;
+
+        for (unsigned r = 0; r < num; ++r)
+        {
+            MixtureParameter* pParam = dynamic_cast<MixtureParameter*>(replicaSet[pIndices ? (*pIndices)[r] : r]);
+
+            if (!pParam)
+                return false;
+
+            VERIFY("replicas of a tile must share the data configuration of the caller"
+                   && pParam->m_pPackedDataSet == m_pPackedDataSet && pParam->m_pBinnedDataSet == m_pBinnedDataSet);
+
+            if (pParam->m_pruningTolerance > 0.0 || pParam->m_w1.size1() != m_w1.size1())
+                isSupported = false;
+
+            params[r] = pParam;
+        }
+
+        if (!isSupported)
+            return false;
+
+        unsigned shardSize = pPool ? BATCH_SHARD_SIZE : m_shardSize;
+
+        if (!pPool)
+            pPool = m_pThreadPool;
+
+        BatchTask task(params, dataSet, m_pBinnedDataSet, numOfTerms(dataSet), shardSize);
+
+        if (pPool)
+        {
+            pPool->parallelFor(task.getNumOfShards(), task);
+        }
+        else
+        {
+            for (unsigned i = 0; i < task.getNumOfShards(); ++i)
+                task.run(i);
+        }
+
+        for (unsigned r = 0; r < num; ++r)
+        {
+            unsigned l = pIndices ? (*pIndices)[r] : r;
+            double h = 0.0;
+
+            for (unsigned i = 0; i < task.getNumOfShards(); ++i)
+                h += task.getPartial(i, r);
+
+            H[l] = h;
+            E[l] = params[r]->prior() + params[r]->m_temperature * h;
+        }
+
+        return true;
+    }
+
+    double shardedEnergy(const std::vector<Data>& dataSet) const
+    {
+        unsigned num = numOfTerms(dataSet);
+        unsigned numOfShards = (num + m_shardSize - 1) / m_shardSize;
+        std::vector<double> partial(numOfShards);
+
+        ShardTask task(*this, dataSet, num, partial);
+        m_pThreadPool->parallelFor(numOfShards, task);
+
+        double sum = 0.0;
+
+        for (unsigned i = 0; i < numOfShards; ++i)
+            sum += partial[i];
+
+        return sum;
+    }
+
+    void getValues(std::vector<double>& values) const
+    {
+        values.resize(m_w1.size1() * m_w1.size2());
+
+        for (unsigned i = 0; i < m_w1.size1(); ++i)
+            for (unsigned j = 0; j < m_w1.size2(); ++j)
+                values[i * m_w1.size2() + j] = m_w1(i, j);
+    }
+
+    void setValues(const std::vector<double>& values)
+    {
+        VERIFY(values.size() == m_w1.size1() * m_w1.size2());
+
+        for (unsigned i = 0; i < m_w1.size1(); ++i)
+            for (unsigned j = 0; j < m_w1.size2(); ++j)
+                m_w1(i, j) = values[i * m_w1.size2() + j];
     }
 
     void print(FILE* fp)
@@ -171,6 +657,193 @@ public:
         pDst->m_w1 = tmp1;
     }
     
+private:
+    static const unsigned GENERATOR_CHUNK_SIZE = 65536;
+    static const unsigned BATCH_SHARD_SIZE = 4096;
+    static const unsigned BATCH_TILE_SIZE = 64;
+    static const unsigned PRUNING_BLOCK_SIZE = 64;
+
+    // data [first + index * GENERATOR_CHUNK_SIZE, ...) of the stream, stored
+    // relative to first
+    class GeneratorTask : public ITask
+    {
+    public:
+        GeneratorTask(const MixtureParameter& param, double* pOut, uint64_t first, uint64_t num, unsigned seed)
+            : m_param(param), m_pOut(pOut), m_first(first), m_num(num), m_seed(seed)
+        {
+            VERIFY((first % GENERATOR_CHUNK_SIZE) == 0);
+
+            double total = 0.0;
+
+            for (unsigned j = 0; j < param.m_w1.size1(); ++j)
+            {
+                VERIFY(param.m_w1(j, 0) >= 0.0);
+
+                total += param.m_w1(j, 0);
+                m_cumulative.push_back(total);
+            }
+
+            VERIFY(total > 0.0);
+
+            for (unsigned j = 0; j < m_cumulative.size(); ++j)
+                m_cumulative[j] /= total;
+        }
+
+        void run(unsigned index)
+        {
+            uint64_t begin = static_cast<uint64_t>(index) * GENERATOR_CHUNK_SIZE;
+            uint64_t end = std::min<uint64_t>(begin + GENERATOR_CHUNK_SIZE, m_num);
+            uint64_t chunk = (m_first + begin) / GENERATOR_CHUNK_SIZE;
+
+            // splitmix64 of (seed, chunk) decorrelates neighbouring streams
+            uint64_t z = (static_cast<uint64_t>(m_seed) << 32) + chunk + 0x9e3779b97f4a7c15ULL;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            z ^= z >> 31;
+
+            boost::mt19937 rng(static_cast<uint32_t>(z ^ (z >> 32)));
+            boost::uniform_real<> uniform(0.0, 1.0);
+            boost::normal_distribution<> normal(0.0, 1.0);
+            boost::variate_generator<boost::mt19937&, boost::uniform_real<> > uniformSampler(rng, uniform);
+            boost::variate_generator<boost::mt19937&, boost::normal_distribution<> > normalSampler(rng, normal);
+
+            unsigned numOfComponents = m_cumulative.size();
+
+            for (uint64_t i = begin; i < end; ++i)
+            {
+                double u = uniformSampler();
+                unsigned j = std::lower_bound(m_cumulative.begin(), m_cumulative.end(), u) - m_cumulative.begin();
+
+                if (j >= numOfComponents)
+                    j = numOfComponents - 1;
+
+                m_pOut[i] = m_param.m_w1(j, 1) + m_param.m_w1(j, 2) * normalSampler();
+            }
+        }
+
+    private:
+        const MixtureParameter& m_param;
+        double* m_pOut;
+        uint64_t m_first;
+        uint64_t m_num;
+        unsigned m_seed;
+        std::vector<double> m_cumulative;
+    };
+
+    // data term of a replica set over the shards of the data
+    class BatchTask : public ITask
+    {
+    public:
+        BatchTask(const std::vector<MixtureParameter*>& params, const std::vector<Data>& dataSet,
+                  const BinnedDataSet* pBinnedDataSet, unsigned num, unsigned shardSize)
+            : m_dataSet(dataSet), m_pBinnedDataSet(pBinnedDataSet), m_num(num), m_shardSize(shardSize),
+              m_numOfReplica(params.size()), m_numOfComponents(params[0]->m_w1.size1())
+        {
+            m_alpha.resize(m_numOfComponents * m_numOfReplica);
+            m_mu.resize(m_numOfComponents * m_numOfReplica);
+
+            for (unsigned j = 0; j < m_numOfComponents; ++j)
+            {
+                for (unsigned r = 0; r < m_numOfReplica; ++r)
+                {
+                    m_alpha[j * m_numOfReplica + r] = params[r]->m_w1(j, 0);
+                    m_mu[j * m_numOfReplica + r] = params[r]->m_w1(j, 1);
+                }
+            }
+
+            m_numOfShards = (num + shardSize - 1) / shardSize;
+            m_partial.assign(m_numOfShards * m_numOfReplica, 0.0);
+        }
+
+        unsigned getNumOfShards() const { return m_numOfShards; }
+        double getPartial(unsigned shard, unsigned r) const { return m_partial[shard * m_numOfReplica + r]; }
+
+        void run(unsigned index)
+        {
+            unsigned tileSize = BATCH_TILE_SIZE;
+            unsigned begin = index * m_shardSize;
+            unsigned n = std::min(begin + m_shardSize, m_num) - begin;
+
+            std::vector<double> y(n), weight(n, 1.0);
+
+            for (unsigned i = 0; i < n; ++i)
+            {
+                if (m_pBinnedDataSet)
+                {
+                    y[i] = m_pBinnedDataSet->getCenters()[begin + i];
+                    weight[i] = m_pBinnedDataSet->getWeights()[begin + i];
+                }
+                else
+                {
+                    y[i] = m_dataSet[begin + i].y(0);
+                }
+            }
+
+            const double norm = sqrt(2 * 3.14);
+            double* pPartial = &m_partial[index * m_numOfReplica];
+            double sum2[BATCH_TILE_SIZE];
+
+            for (unsigned t = 0; t < m_numOfReplica; t += tileSize)
+            {
+                unsigned m = std::min(tileSize, m_numOfReplica - t);
+
+                for (unsigned i = 0; i < n; ++i)
+                {
+                    for (unsigned r = 0; r < m; ++r)
+                        sum2[r] = 0.0;
+
+                    for (unsigned j = 0; j < m_numOfComponents; ++j)
+                    {
+                        const double* a = &m_alpha[j * m_numOfReplica + t];
+                        const double* mu = &m_mu[j * m_numOfReplica + t];
+
+                        for (unsigned r = 0; r < m; ++r)
+                        {
+                            double d = y[i] - mu[r];
+                            sum2[r] += a[r] * exp(- d * d / 2.0);
+                        }
+                    }
+
+                    for (unsigned r = 0; r < m; ++r)
+                        pPartial[t + r] += -weight[i] * log(sum2[r] / norm);
+                }
+            }
+        }
+
+    private:
+        const std::vector<Data>& m_dataSet;
+        const BinnedDataSet* m_pBinnedDataSet;
+        unsigned m_num;
+        unsigned m_shardSize;
+        unsigned m_numOfReplica;
+        unsigned m_numOfComponents;
+        unsigned m_numOfShards;
+        std::vector<double> m_alpha;    // [component][replica]
+        std::vector<double> m_mu;       // [component][replica]
+        std::vector<double> m_partial;  // [shard][replica]
+    };
+
+    class ShardTask : public ITask
+    {
+    public:
+        ShardTask(const MixtureParameter& param, const std::vector<Data>& dataSet, unsigned num, std::vector<double>& partial)
+            : m_param(param), m_dataSet(dataSet), m_num(num), m_partial(partial) {}
+
+        void run(unsigned index)
+        {
+            unsigned begin = index * m_param.m_shardSize;
+            unsigned end = std::min(begin + m_param.m_shardSize, m_num);
+
+            m_partial[index] = m_param.partialEnergy(m_dataSet, begin, end);
+        }
+
+    private:
+        const MixtureParameter& m_param;
+        const std::vector<Data>& m_dataSet;
+        unsigned m_num;
+        std::vector<double>& m_partial;
+    };
+
 // private:
 public:
     RandomGenerator* m_pRng;
@@ -181,6 +854,14 @@ public:
     double m_temperature;
 
     ublas::matrix<double> m_tmp_w1;
+
+    ThreadPool* m_pThreadPool;
+    unsigned m_shardSize;
+
+    const PackedDataSet<float>* m_pPackedDataSet;
+    const BinnedDataSet* m_pBinnedDataSet;
+    const BinnedDataSet* m_pSurrogateDataSet;
+    double m_pruningTolerance;
 };
 
 
@@ -0,0 +1,84 @@
+#ifndef PACKED_DATA_SET_H_
+#define PACKED_DATA_SET_H_
+
+#include <vector>
+#include <stdint.h>
+
+#include "bayesbox/Bayes.h"
+#include "common/verify.h"
+
+
+// Contiguous copy of the y values of a data set, stored as T (typically
+// float to halve the memory traffic of the energy loop).
+template <typename T> class PackedDataSet
+{
+public:
+    PackedDataSet() : m_size(0), m_dimension(0) {}
+    PackedDataSet(const std::vector<Data>& dataSet) : m_size(0), m_dimension(0) { set(dataSet); }
+
+    void set(const std::vector<Data>& dataSet)
+    {
+        m_size = dataSet.size();
+        m_dimension = m_size ? dataSet[0].y.size() : 0;
+        m_y.resize(m_size * m_dimension);
+
+        for (unsigned i = 0; i < m_size; ++i)
+        {
+            VERIFY(dataSet[i].y.size() == m_dimension);
+
+            for (unsigned k = 0; k < m_dimension; ++k)
+                m_y[i * m_dimension + k] = static_cast<T>(dataSet[i].y(k));
+        }
+    }
+
+    unsigned size() const { return m_size; }
+    unsigned getDimension() const { return m_dimension; }
+    // 0 for an empty data set
+    const T* getY(unsigned i = 0) const { return m_y.empty() ? 0 : &m_y[0] + i * m_dimension; }
+
+private:
+    std::vector<T> m_y;
+    unsigned m_size;
+    unsigned m_dimension;
+};
+
+
+// Cascade (pairwise) summation: the error grows with log(n) instead of n
+// and, unlike Kahan, it survives -ffast-math reassociation.
+class PairwiseSum
+{
+public:
+    PairwiseSum() : m_count(0) {}
+
+    void add(double v)
+    {
+        unsigned level = 0;
+
+        for (uint64_t c = m_count; c & 1; c >>= 1)
+            v += m_partial[level++];
+
+        m_partial[level] = v;
+        ++m_count;
+    }
+
+    double sum() const
+    {
+        double s = 0.0;
+        unsigned level = 0;
+
+        for (uint64_t c = m_count; c; c >>= 1, ++level)
+        {
+            if (c & 1)
+                s += m_partial[level];
+        }
+
+        return s;
+    }
+
+private:
+    uint64_t m_count;
+    double m_partial[64];
+};
+
+
+#endif // PACKED_DATA_SET_H_
@@ -0,0 +1,314 @@
+#ifndef POPULATION_ANNEALING_H_
+#define POPULATION_ANNEALING_H_
+
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "bayesbox/Bayes.h"
+#include "bayesbox/RandomGenerator.h"
+#include "common/verify.h"
+#include "common/ThreadPool.h"
+
+
+// Population annealing / sequential Monte Carlo over an inverse temperature
+// schedule.  A population of clones of a seed parameter is moved from
+// schedule[0] to schedule.back(); at every step the particles are
+// reweighted by exp(-(beta_k - beta_k-1) h), resampled (systematic) when the
+// effective sample size drops below the threshold, and then moved with
+// Metropolis steps at beta_k.
+//
+// The moves of a step run on the pool in fixed shards of particles, every
+// shard with its own generator (IMCMCParameter::setRng()), so the result
+// depends on the seed only.  The log normalizer ratio log Z(beta_K) /
+// Z(beta_0) is accumulated along the way; with schedule[0] = 0 it is the log
+// marginal likelihood of the data term.
+class PopulationAnnealing
+{
+public:
+    PopulationAnnealing(IMCMCParameter& seedParam, unsigned numOfParticles, unsigned seed,
+                        ThreadPool* pPool = 0, unsigned numOfShards = 64)
+        : m_pDataSet(0), m_pPool(pPool), m_rng(seed), m_numOfMoves(10), m_resampleThreshold(0.5), m_logZ(0.0)
+    {
+        VERIFY(numOfParticles > 0 && numOfShards > 0);
+
+        numOfShards = std::min(numOfShards, numOfParticles);
+
+        for (unsigned s = 0; s < numOfShards; ++s)
+            m_generators.push_back(new RandomGenerator(seed + 1 + s * 0x9e3779b9u));
+
+        for (unsigned i = 0; i < numOfParticles; ++i)
+            seedParam.push(m_particles);
+
+        m_h.resize(numOfParticles);
+        m_E.resize(numOfParticles);
+        m_logW.assign(numOfParticles, -log(static_cast<double>(numOfParticles)));
+    }
+
+    ~PopulationAnnealing()
+    {
+        for (unsigned i = 0; i < m_particles.size(); ++i)
+            delete m_particles[i];
+
+        for (unsigned s = 0; s < m_generators.size(); ++s)
+            delete m_generators[s];
+    }
+
+    void setDataSet(std::vector<Data>& dataSet) { m_pDataSet = &dataSet; }
+
+    // Metropolis steps per particle and temperature
+    void setNumOfMoves(int numOfMoves) { m_numOfMoves = numOfMoves; }
+
+    // resample when ESS < threshold * particles; 1 resamples every step
+    void setResampleThreshold(double threshold) { m_resampleThreshold = threshold; }
+
+    // burnIn moves at schedule[0] spread the identical initial clones; log Z
+    // is only as good as the population at schedule[0], so with a wide
+    // prior burnIn has to be long enough to cover it
+    void run(const std::vector<double>& schedule, int burnIn = 100)
+    {
+        VERIFY(m_pDataSet != 0 && !schedule.empty());
+
+        m_statistics.clear();
+        m_logZ = 0.0;
+
+        MoveTask init(*this, schedule[0], 0, 0);
+        runShards(init);
+
+        MoveTask burn(*this, schedule[0], 0, burnIn);
+        runShards(burn);
+
+        for (unsigned k = 1; k < schedule.size(); ++k)
+        {
+            double dBeta = schedule[k] - schedule[k - 1];
+            unsigned numOfParticles = m_particles.size();
+
+            // reweighting and the normalizer ratio of this step
+            std::vector<double> logW(numOfParticles);
+
+            for (unsigned i = 0; i < numOfParticles; ++i)
+                logW[i] = m_logW[i] - dBeta * m_h[i];
+
+            double logSum = logSumExp(logW);
+            double sum2 = 0.0;
+
+            m_logZ += logSum;
+
+            for (unsigned i = 0; i < numOfParticles; ++i)
+            {
+                m_logW[i] = logW[i] - logSum;
+                m_E[i] += dBeta * m_h[i];
+                sum2 += exp(2.0 * m_logW[i]);
+            }
+
+            Statistics statistics;
+            statistics.beta = schedule[k];
+            statistics.ess = 1.0 / sum2;
+            statistics.isResampled = statistics.ess < m_resampleThreshold * numOfParticles;
+            statistics.logZ = m_logZ;
+
+            if (statistics.isResampled)
+                resample();
+
+            MoveTask move(*this, schedule[k], m_numOfMoves, 0);
+            runShards(move);
+
+            statistics.acceptRatio = move.getAcceptRatio();
+            m_statistics.push_back(statistics);
+        }
+    }
+
+    // log Z(schedule.back()) - log Z(schedule[0])
+    double getLogZ() const { return m_logZ; }
+
+    unsigned getNumOfParticles() const { return m_particles.size(); }
+
+    // num (all particles by default) equally weighted clones drawn from the
+    // final population, e.g. into the parameter set of a Model
+    void push(std::vector<IMCMCParameter*>& paramSet, unsigned num = 0)
+    {
+        std::vector<unsigned> ancestors;
+        systematic(num ? num : m_particles.size(), ancestors);
+
+        for (unsigned i = 0; i < ancestors.size(); ++i)
+            m_particles[ancestors[i]]->push(paramSet);
+    }
+
+    void printStatistics(FILE* fp) const
+    {
+        for (unsigned k = 0; k < m_statistics.size(); ++k)
+        {
+            fprintf(fp, "[%f] ESS = %f, resampled = %d, accept ratio = %f, log Z = %f\n",
+                    m_statistics[k].beta, m_statistics[k].ess, m_statistics[k].isResampled ? 1 : 0,
+                    m_statistics[k].acceptRatio, m_statistics[k].logZ);
+        }
+    }
+
+private:
+    struct Statistics
+    {
+        double beta;
+        double ess;
+        bool isResampled;
+        double acceptRatio;
+        double logZ;
+    };
+
+    static double logSumExp(const std::vector<double>& v)
+    {
+        double max = *std::max_element(v.begin(), v.end());
+        double sum = 0.0;
+
+        for (unsigned i = 0; i < v.size(); ++i)
+            sum += exp(v[i] - max);
+
+        return max + log(sum);
+    }
+
+    // systematic resampling of num ancestors by the current weights
+    void systematic(unsigned num, std::vector<unsigned>& ancestors)
+    {
+        double u = m_rng.uniform() / num;
+        double cumulative = 0.0;
+        unsigned i = 0;
+
+        ancestors.clear();
+
+        for (unsigned n = 0; n < num; ++n)
+        {
+            double target = u + static_cast<double>(n) / num;
+
+            while (i + 1 < m_particles.size() && cumulative + exp(m_logW[i]) < target)
+                cumulative += exp(m_logW[i++]);
+
+            ancestors.push_back(i);
+        }
+    }
+
+    void resample()
+    {
+        unsigned numOfParticles = m_particles.size();
+        std::vector<unsigned> ancestors;
+        std::vector<IMCMCParameter*> particles;
+
+        systematic(numOfParticles, ancestors);
+
+        std::vector<double> h(numOfParticles), E(numOfParticles);
+
+        for (unsigned i = 0; i < numOfParticles; ++i)
+        {
+            m_particles[ancestors[i]]->push(particles);
+            h[i] = m_h[ancestors[i]];
+            E[i] = m_E[ancestors[i]];
+        }
+
+        for (unsigned i = 0; i < numOfParticles; ++i)
+            delete m_particles[i];
+
+        m_particles.swap(particles);
+        m_h.swap(h);
+        m_E.swap(E);
+        m_logW.assign(numOfParticles, -log(static_cast<double>(numOfParticles)));
+    }
+
+    void runShards(ITask& task)
+    {
+        if (m_pPool)
+        {
+            m_pPool->parallelFor(m_generators.size(), task);
+        }
+        else
+        {
+            for (unsigned s = 0; s < m_generators.size(); ++s)
+                task.run(s);
+        }
+    }
+
+    // Metropolis moves of the particles of a shard at beta; with no moves
+    // and no burn-in only the energies are evaluated
+    class MoveTask : public ITask
+    {
+    public:
+        MoveTask(PopulationAnnealing& annealing, double beta, int numOfMoves, int burnIn)
+            : m_annealing(annealing), m_beta(beta), m_numOfMoves(numOfMoves + burnIn),
+              m_acceptCounts(annealing.m_generators.size(), 0) {}
+
+        void run(unsigned index)
+        {
+            PopulationAnnealing& a = m_annealing;
+            RandomGenerator& rng = *a.m_generators[index];
+            unsigned numOfShards = a.m_generators.size();
+            unsigned begin = static_cast<unsigned>(static_cast<uint64_t>(a.m_particles.size()) * index / numOfShards);
+            unsigned end = static_cast<unsigned>(static_cast<uint64_t>(a.m_particles.size()) * (index + 1) / numOfShards);
+
+            for (unsigned i = begin; i < end; ++i)
+            {
+                IMCMCParameter* pParam = a.m_particles[i];
+
+                // the energies at beta are already known from reweighting
+                pParam->setRng(rng);
+                pParam->setTemperature(m_beta);
+
+                if (m_numOfMoves == 0)
+                    a.m_E[i] = pParam->energy(*a.m_pDataSet, a.m_h[i]);
+
+                for (int m = 0; m < m_numOfMoves; ++m)
+                {
+                    double h;
+
+                    pParam->next(m);
+                    double E = pParam->energy(*a.m_pDataSet, h);
+                    double dE = E - a.m_E[i];
+
+                    if ((dE <= 0) || (rng.uniform() < exp(-dE)))
+                    {
+                        pParam->accept();
+                        a.m_E[i] = E;
+                        a.m_h[i] = h;
+
+                        ++m_acceptCounts[index];
+                    }
+                    else
+                    {
+                        pParam->reject();
+                    }
+                }
+            }
+        }
+
+        double getAcceptRatio() const
+        {
+            double count = 0.0;
+
+            for (unsigned s = 0; s < m_acceptCounts.size(); ++s)
+                count += m_acceptCounts[s];
+
+            return (m_numOfMoves > 0) ? count / (static_cast<double>(m_numOfMoves) * m_annealing.m_particles.size()) : 0.0;
+        }
+
+    private:
+        PopulationAnnealing& m_annealing;
+        double m_beta;
+        int m_numOfMoves;
+        std::vector<unsigned> m_acceptCounts;
+    };
+
+    std::vector<Data>* m_pDataSet;
+    ThreadPool* m_pPool;
+    RandomGenerator m_rng;
+    int m_numOfMoves;
+    double m_resampleThreshold;
+
+    std::vector<RandomGenerator*> m_generators;    // one per shard
+    std::vector<IMCMCParameter*> m_particles;
+    std::vector<double> m_h;
+    std::vector<double> m_E;
+    std::vector<double> m_logW;                     // normalized
+
+    double m_logZ;
+    std::vector<Statistics> m_statistics;
+};
+
+
+#endif // POPULATION_ANNEALING_H_
@@ -26,6 +26,11 @@ public:
         m_boost_rng = new boost::mt19937(static_cast<unsigned>(now));
     }
 
+    RandomGenerator(unsigned seed)
+    {
+        m_boost_rng = new boost::mt19937(seed);
+    }
+
     ~RandomGenerator()
     {
         delete m_boost_rng;
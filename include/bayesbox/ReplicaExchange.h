@@ -0,0 +1,315 @@
+#ifndef REPLICA_EXCHANGE_H_
+#define REPLICA_EXCHANGE_H_
+
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+#include "RandomGenerator.h"
+#include "common/verify.h"
+#include "common/Transport.h"
+
+
+// Replica exchange between processes.  Every process keeps the state of
+// its own replicas; only the ladder position (temperature index) of a
+// replica moves.  Each round every process sends (position, H) of its
+// replicas to the coordinator, which decides the swaps of neighbouring
+// positions and sends the new positions back: 12 bytes up and 4 bytes
+// down per replica, in framed Messages.  The coordinator is one of the
+// sampling processes.  Samples of position 0, which any process may hold,
+// are streamed to it: a worker's addSample() rides on its next exchange()
+// message (or flush() after the run), so a worker holds at most the
+// samples of one round.
+class DistributedExchange
+{
+public:
+    struct Sample
+    {
+        uint32_t iteration;
+        std::vector<double> values;
+    };
+
+    // coordinator; localIndices are the initial ladder positions of the
+    // local replicas, the workers hold all the other positions
+    DistributedExchange(const std::vector<double>& temperatures, const std::vector<unsigned>& localIndices,
+                        std::vector<ITransport*>& workers, RandomGenerator& rng)
+        : m_temperatures(temperatures), m_indices(localIndices), m_pCoordinator(0), m_workers(workers), m_pRng(&rng),
+          m_exchangeAcceptCount(temperatures.size(), 0), m_exchangeTotalCount(temperatures.size(), 0)
+    {
+        init();
+    }
+
+    // worker
+    DistributedExchange(const std::vector<double>& temperatures, const std::vector<unsigned>& localIndices,
+                        ITransport& coordinator)
+        : m_temperatures(temperatures), m_indices(localIndices), m_pCoordinator(&coordinator), m_pRng(0)
+    {
+        init();
+    }
+
+    bool isCoordinator() const { return m_pCoordinator == 0; }
+
+    unsigned getNumOfLocalReplicas() const { return m_indices.size(); }
+    unsigned getIndex(unsigned l) const { return m_indices[l]; }
+    double getTemperature(unsigned l) const { return m_temperatures[m_indices[l]]; }
+
+    // one round over the even or odd neighbour pairs (by iteration);
+    // H[l] is the data term of local replica l
+    void exchange(unsigned iteration, const double* H)
+    {
+        if (m_pCoordinator)
+        {
+            m_message.clear();
+            m_message.putUint32(m_indices.size());
+
+            for (unsigned l = 0; l < m_indices.size(); ++l)
+            {
+                m_message.putUint32(m_indices[l]);
+                m_message.putDouble(H[l]);
+            }
+
+            putSamples();
+            m_message.send(*m_pCoordinator);
+            m_message.recv(*m_pCoordinator);
+
+            VERIFY(m_message.getUint32() == m_indices.size());
+
+            for (unsigned l = 0; l < m_indices.size(); ++l)
+            {
+                m_indices[l] = m_message.getUint32();
+                VERIFY(m_indices[l] < m_temperatures.size());
+            }
+
+            VERIFY(m_message.isEnd());
+        }
+        else
+        {
+            m_entries.resize(m_indices.size());
+
+            for (unsigned l = 0; l < m_indices.size(); ++l)
+            {
+                m_entries[l].index = m_indices[l];
+                m_entries[l].h = H[l];
+            }
+
+            coordinate(iteration);
+        }
+    }
+
+    // worker: sent to the coordinator with the next exchange() or flush()
+    void addSample(unsigned iteration, const std::vector<double>& values)
+    {
+        VERIFY(!isCoordinator());
+
+        m_outbox.push_back(Sample());
+        m_outbox.back().iteration = iteration;
+        m_outbox.back().values = values;
+    }
+
+    // Once after the run, on every process: a worker sends the samples not
+    // sent yet, the coordinator receives them.
+    void flush()
+    {
+        if (m_pCoordinator)
+        {
+            m_message.clear();
+            putSamples();
+            m_message.send(*m_pCoordinator);
+
+            return;
+        }
+
+        for (unsigned w = 0; w < m_workers.size(); ++w)
+        {
+            m_message.recv(*m_workers[w]);
+            getSamples();
+            VERIFY(m_message.isEnd());
+        }
+    }
+
+    // coordinator: moves the samples received by the last exchange() or
+    // flush() into samples, in iteration order
+    void takeSamples(std::vector<Sample>& samples)
+    {
+        std::stable_sort(m_inbox.begin(), m_inbox.end(), isEarlier);
+
+        samples.clear();
+        samples.swap(m_inbox);
+    }
+
+    // acceptance ratio per neighbour pair, coordinator only
+    void printStatistics(FILE* fp) const
+    {
+        VERIFY(isCoordinator());
+
+        for (unsigned p = 0; p + 1 < m_temperatures.size(); ++p)
+        {
+            fprintf(fp, "[%f - %f] exchange ratio = %f\n", m_temperatures[p], m_temperatures[p + 1],
+                    (double)m_exchangeAcceptCount[p] / (double)m_exchangeTotalCount[p]);
+        }
+    }
+
+private:
+    struct Entry
+    {
+        uint32_t index;
+        double h;
+    };
+
+    // where a ladder position currently lives
+    struct Owner
+    {
+        unsigned source;    // 0 = coordinator, 1 + i = m_workers[i]
+        unsigned slot;
+        double h;
+    };
+
+    void init()
+    {
+        VERIFY(!m_indices.empty());
+
+        for (unsigned l = 0; l < m_indices.size(); ++l)
+            VERIFY(m_indices[l] < m_temperatures.size());
+    }
+
+    static bool isEarlier(const Sample& a, const Sample& b) { return a.iteration < b.iteration; }
+
+    // m_outbox to m_message
+    void putSamples()
+    {
+        m_message.putUint32(m_outbox.size());
+
+        for (unsigned n = 0; n < m_outbox.size(); ++n)
+        {
+            m_message.putUint32(m_outbox[n].iteration);
+            m_message.putUint32(m_outbox[n].values.size());
+
+            for (unsigned d = 0; d < m_outbox[n].values.size(); ++d)
+                m_message.putDouble(m_outbox[n].values[d]);
+        }
+
+        m_outbox.clear();
+    }
+
+    // m_message to m_inbox
+    void getSamples()
+    {
+        uint32_t num = m_message.getUint32();
+
+        for (uint32_t n = 0; n < num; ++n)
+        {
+            m_inbox.push_back(Sample());
+
+            Sample& sample = m_inbox.back();
+            sample.iteration = m_message.getUint32();
+            sample.values.resize(m_message.getUint32());
+
+            for (unsigned d = 0; d < sample.values.size(); ++d)
+                sample.values[d] = m_message.getDouble();
+        }
+    }
+
+    void coordinate(unsigned iteration)
+    {
+        unsigned numOfPositions = m_temperatures.size();
+        Owner none = { ~0u, 0, 0.0 };
+
+        m_owners.assign(numOfPositions, none);
+        m_sources.resize(m_workers.size() + 1);
+        m_sources[0] = m_entries;
+
+        for (unsigned w = 0; w < m_workers.size(); ++w)
+        {
+            m_message.recv(*m_workers[w]);
+
+            std::vector<Entry>& entries = m_sources[w + 1];
+            entries.resize(m_message.getUint32());
+
+            for (unsigned l = 0; l < entries.size(); ++l)
+            {
+                entries[l].index = m_message.getUint32();
+                entries[l].h = m_message.getDouble();
+            }
+
+            getSamples();
+            VERIFY(m_message.isEnd());
+        }
+
+        for (unsigned s = 0; s < m_sources.size(); ++s)
+        {
+            for (unsigned l = 0; l < m_sources[s].size(); ++l)
+            {
+                const Entry& entry = m_sources[s][l];
+
+                VERIFY(entry.index < numOfPositions && m_owners[entry.index].source == ~0u);
+
+                Owner owner = { s, l, entry.h };
+                m_owners[entry.index] = owner;
+            }
+        }
+
+        for (unsigned p = 0; p < numOfPositions; ++p)
+            VERIFY("every ladder position needs a replica" && m_owners[p].source != ~0u);
+
+        for (unsigned p = iteration & 0x1; p + 1 < numOfPositions; p += 2)
+        {
+            double r = exp((m_temperatures[p + 1] - m_temperatures[p]) * (m_owners[p + 1].h - m_owners[p].h));
+
+            if (m_pRng->uniform() < r)
+            {
+                Owner tmp = m_owners[p];
+                m_owners[p] = m_owners[p + 1];
+                m_owners[p + 1] = tmp;
+
+                ++m_exchangeAcceptCount[p];
+            }
+
+            ++m_exchangeTotalCount[p];
+        }
+
+        m_replies.resize(m_sources.size());
+
+        for (unsigned s = 0; s < m_sources.size(); ++s)
+            m_replies[s].resize(m_sources[s].size());
+
+        for (unsigned p = 0; p < numOfPositions; ++p)
+            m_replies[m_owners[p].source][m_owners[p].slot] = p;
+
+        for (unsigned l = 0; l < m_indices.size(); ++l)
+            m_indices[l] = m_replies[0][l];
+
+        for (unsigned w = 0; w < m_workers.size(); ++w)
+        {
+            m_message.clear();
+            m_message.putUint32(m_replies[w + 1].size());
+
+            for (unsigned l = 0; l < m_replies[w + 1].size(); ++l)
+                m_message.putUint32(m_replies[w + 1][l]);
+
+            m_message.send(*m_workers[w]);
+        }
+    }
+
+    std::vector<double> m_temperatures;
+    std::vector<unsigned> m_indices;
+
+    ITransport* m_pCoordinator;
+    Message m_message;
+    std::vector<Entry> m_entries;
+    std::vector<Sample> m_outbox;
+    std::vector<Sample> m_inbox;
+
+    // coordinator only
+    std::vector<ITransport*> m_workers;
+    RandomGenerator* m_pRng;
+    std::vector<unsigned> m_exchangeAcceptCount;
+    std::vector<unsigned> m_exchangeTotalCount;
+    std::vector< std::vector<Entry> > m_sources;
+    std::vector< std::vector<uint32_t> > m_replies;
+    std::vector<Owner> m_owners;
+};
+
+
+#endif // REPLICA_EXCHANGE_H_
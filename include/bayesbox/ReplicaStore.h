@@ -0,0 +1,41 @@
+#ifndef REPLICA_STORE_H_
+#define REPLICA_STORE_H_
+
+#include <vector>
+
+
+// Per-replica state of Model::MCMC() as parallel arrays on the heap, so the
+// number of replicas is not bounded by the stack and every quantity is
+// contiguous over the replicas.
+struct ReplicaStore
+{
+    ReplicaStore(unsigned numOfReplica)
+        : E(numOfReplica), H(numOfReplica), nextE(numOfReplica), nextH(numOfReplica),
+          S(numOfReplica), nextS(numOfReplica), surrogateH(numOfReplica), isScreened(numOfReplica, 1),
+          exchangeAcceptCount(numOfReplica, 0.0), exchangeTotalCount(numOfReplica, 0.0),
+          samplingAcceptCount(numOfReplica, 0.0), samplingTotalCount(numOfReplica, 0.0),
+          screenPassCount(numOfReplica, 0.0) {}
+
+    unsigned size() const { return E.size(); }
+
+    // energy and data term of the current and the proposed state
+    std::vector<double> E;
+    std::vector<double> H;
+    std::vector<double> nextE;
+    std::vector<double> nextH;
+
+    // delayed acceptance: surrogate energies and first stage outcome
+    std::vector<double> S;
+    std::vector<double> nextS;
+    std::vector<double> surrogateH;
+    std::vector<char> isScreened;
+
+    std::vector<double> exchangeAcceptCount;
+    std::vector<double> exchangeTotalCount;
+    std::vector<double> samplingAcceptCount;
+    std::vector<double> samplingTotalCount;
+    std::vector<double> screenPassCount;
+};
+
+
+#endif // REPLICA_STORE_H_
@@ -0,0 +1,361 @@
+#ifndef RETENTION_POLICY_H_
+#define RETENTION_POLICY_H_
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+#include <boost/numeric/ublas/vector.hpp>
+
+#include "bayesbox/Bayes.h"
+#include "bayesbox/RandomGenerator.h"
+#include "common/verify.h"
+
+
+// Uniform random subset of at most capacity of all samples offered so far
+// (reservoir sampling, algorithm R).  The generator is its own, so the
+// chain is the same as without the policy.
+class ReservoirPolicy : public IRetentionPolicy
+{
+public:
+    ReservoirPolicy(unsigned capacity, unsigned seed = 1) : m_capacity(capacity), m_numOfOffered(0), m_rng(seed)
+    {
+        VERIFY(capacity > 0);
+    }
+
+    void retain(IMCMCParameter& param, std::vector<IMCMCParameter*>& paramSet)
+    {
+        ++m_numOfOffered;
+
+        if (paramSet.size() < m_capacity)
+        {
+            param.push(paramSet);
+            return;
+        }
+
+        uint64_t j = static_cast<uint64_t>(m_rng.uniform() * m_numOfOffered);
+
+        if (j < paramSet.size())
+        {
+            param.push(paramSet);
+
+            delete paramSet[j];
+            paramSet[j] = paramSet.back();
+            paramSet.pop_back();
+        }
+    }
+
+    uint64_t getNumOfOffered() const { return m_numOfOffered; }
+
+private:
+    unsigned m_capacity;
+    uint64_t m_numOfOffered;
+    RandomGenerator m_rng;
+};
+
+
+// Evenly thinned samples in at most capacity: every stride-th offered
+// sample is kept, and whenever the set is full every other sample is
+// dropped and stride doubles, so the set always spans the whole run at
+// step * getStride().
+class ThinningPolicy : public IRetentionPolicy
+{
+public:
+    ThinningPolicy(unsigned capacity) : m_capacity(capacity), m_stride(1), m_numOfOffered(0)
+    {
+        VERIFY(capacity >= 2);
+    }
+
+    void retain(IMCMCParameter& param, std::vector<IMCMCParameter*>& paramSet)
+    {
+        if ((m_numOfOffered++ % m_stride) != 0)
+            return;
+
+        param.push(paramSet);
+
+        if (paramSet.size() < m_capacity)
+            return;
+
+        unsigned n = 0;
+
+        for (unsigned i = 0; i < paramSet.size(); ++i)
+        {
+            if ((i % 2) == 0)
+                paramSet[n++] = paramSet[i];
+            else
+                delete paramSet[i];
+        }
+
+        paramSet.resize(n);
+        m_stride *= 2;
+    }
+
+    uint64_t getStride() const { return m_stride; }
+
+private:
+    unsigned m_capacity;
+    uint64_t m_stride;
+    uint64_t m_numOfOffered;
+};
+
+
+// Streaming estimate of the p-quantile in five markers (the P^2 algorithm
+// of Jain and Chlamtac); exact up to five values.
+class P2Quantile
+{
+public:
+    P2Quantile(double p = 0.5) : m_p(p), m_count(0)
+    {
+        VERIFY(p >= 0.0 && p <= 1.0);
+    }
+
+    double getProbability() const { return m_p; }
+    uint64_t getCount() const { return m_count; }
+
+    void add(double x)
+    {
+        if (m_count < 5)
+        {
+            m_q[m_count++] = x;
+
+            if (m_count == 5)
+            {
+                std::sort(m_q, m_q + 5);
+
+                double desired[5] = { 0.0, 2.0 * m_p, 4.0 * m_p, 2.0 + 2.0 * m_p, 4.0 };
+                double increment[5] = { 0.0, m_p / 2.0, m_p, (1.0 + m_p) / 2.0, 1.0 };
+
+                for (int i = 0; i < 5; ++i)
+                {
+                    m_n[i] = i;
+                    m_desired[i] = desired[i];
+                    m_increment[i] = increment[i];
+                }
+            }
+
+            return;
+        }
+
+        int k;
+
+        if (x < m_q[0])
+        {
+            m_q[0] = x;
+            k = 0;
+        }
+        else if (x >= m_q[4])
+        {
+            m_q[4] = x;
+            k = 3;
+        }
+        else
+        {
+            for (k = 0; x >= m_q[k + 1]; ++k)
+                ;
+        }
+
+        for (int i = k + 1; i < 5; ++i)
+            m_n[i] += 1.0;
+
+        for (int i = 0; i < 5; ++i)
+            m_desired[i] += m_increment[i];
+
+        for (int i = 1; i <= 3; ++i)
+        {
+            double d = m_desired[i] - m_n[i];
+
+            if ((d >= 1.0 && m_n[i + 1] - m_n[i] > 1.0) || (d <= -1.0 && m_n[i - 1] - m_n[i] < -1.0))
+            {
+                int s = (d >= 0.0) ? 1 : -1;
+                double q = parabolic(i, s);
+
+                m_q[i] = (m_q[i - 1] < q && q < m_q[i + 1]) ? q : linear(i, s);
+                m_n[i] += s;
+            }
+        }
+
+        ++m_count;
+    }
+
+    // linearly interpolated as Model::predictQuantile() while exact
+    double get() const
+    {
+        VERIFY(m_count > 0);
+
+        if (m_count >= 5)
+            return m_q[2];
+
+        double q[5];
+        std::copy(m_q, m_q + m_count, q);
+        std::sort(q, q + m_count);
+
+        double position = m_p * (m_count - 1);
+        unsigned lower = static_cast<unsigned>(position);
+
+        return (lower + 1 < m_count) ? q[lower] + (position - lower) * (q[lower + 1] - q[lower]) : q[lower];
+    }
+
+private:
+    double parabolic(int i, int s) const
+    {
+        return m_q[i] + s / (m_n[i + 1] - m_n[i - 1])
+            * ((m_n[i] - m_n[i - 1] + s) * (m_q[i + 1] - m_q[i]) / (m_n[i + 1] - m_n[i])
+               + (m_n[i + 1] - m_n[i] - s) * (m_q[i] - m_q[i - 1]) / (m_n[i] - m_n[i - 1]));
+    }
+
+    double linear(int i, int s) const
+    {
+        return m_q[i] + s * (m_q[i + s] - m_q[i]) / (m_n[i + s] - m_n[i]);
+    }
+
+    double m_p;
+    uint64_t m_count;
+    double m_q[5];          // marker heights
+    double m_n[5];          // marker positions
+    double m_desired[5];
+    double m_increment[5];
+};
+
+
+// Keeps no samples, only per scalar the mean, the variance and P^2
+// estimates of the given quantiles, of the parameter values (getValues())
+// and of value() at the query points added before the run.  The parameter
+// set stays empty: of the Model queries only value() at a query point is
+// supported (answered from these); value() elsewhere, predict(),
+// predictQuantile() and WAIC() fail their VERIFY.  Everything else is read
+// from the policy itself.
+class SummaryPolicy : public IRetentionPolicy
+{
+public:
+    SummaryPolicy(const std::vector<double>& quantiles = std::vector<double>())
+        : m_quantiles(quantiles), m_numOfSamples(0) {}
+
+    void addQuery(const ublas::vector<double>& x)
+    {
+        VERIFY("queries must be added before the first sample" && m_numOfSamples == 0);
+        m_queries.push_back(x);
+        m_querySummaries.push_back(std::vector<Summary>());
+    }
+
+    void retain(IMCMCParameter& param, std::vector<IMCMCParameter*>& /* paramSet */)
+    {
+        param.getValues(m_values);
+        add(m_values, m_summaries);
+
+        for (unsigned q = 0; q < m_queries.size(); ++q)
+        {
+            param.value(m_queries[q], m_y);
+            m_values.assign(m_y.begin(), m_y.end());
+            add(m_values, m_querySummaries[q]);
+        }
+
+        ++m_numOfSamples;
+    }
+
+    bool value(const ublas::vector<double>& x, ublas::vector<double>& y) const
+    {
+        if (m_numOfSamples == 0)
+            return false;
+
+        for (unsigned q = 0; q < m_queries.size(); ++q)
+        {
+            if (m_queries[q].size() != x.size() || !std::equal(x.begin(), x.end(), m_queries[q].begin()))
+                continue;
+
+            y.resize(m_querySummaries[q].size());
+
+            for (unsigned d = 0; d < y.size(); ++d)
+                y(d) = m_querySummaries[q][d].mean;
+
+            return true;
+        }
+
+        return false;
+    }
+
+    uint64_t getNumOfSamples() const { return m_numOfSamples; }
+    unsigned getDimension() const { return m_summaries.size(); }
+    unsigned getNumOfQueries() const { return m_queries.size(); }
+
+    // of parameter value d
+    double getMean(unsigned d) const { return at(m_summaries, d).mean; }
+    double getVariance(unsigned d) const { return at(m_summaries, d).getVariance(); }
+    double getQuantile(unsigned d, unsigned k) const { return at(m_summaries, d).getQuantile(k); }
+
+    // of dimension d of value() at query q
+    double getQueryMean(unsigned q, unsigned d) const { return at(queryAt(q), d).mean; }
+    double getQueryVariance(unsigned q, unsigned d) const { return at(queryAt(q), d).getVariance(); }
+    double getQueryQuantile(unsigned q, unsigned d, unsigned k) const { return at(queryAt(q), d).getQuantile(k); }
+
+private:
+    struct Summary
+    {
+        Summary(const std::vector<double>& quantiles) : count(0), mean(0.0), m2(0.0)
+        {
+            for (unsigned k = 0; k < quantiles.size(); ++k)
+                sketches.push_back(P2Quantile(quantiles[k]));
+        }
+
+        void add(double x)
+        {
+            double delta = x - mean;
+
+            ++count;
+            mean += delta / count;
+            m2 += delta * (x - mean);
+
+            for (unsigned k = 0; k < sketches.size(); ++k)
+                sketches[k].add(x);
+        }
+
+        double getVariance() const { return (count > 0) ? m2 / count : 0.0; }
+
+        double getQuantile(unsigned k) const
+        {
+            VERIFY(k < sketches.size());
+            return sketches[k].get();
+        }
+
+        uint64_t count;
+        double mean;
+        double m2;
+        std::vector<P2Quantile> sketches;
+    };
+
+    void add(const std::vector<double>& values, std::vector<Summary>& summaries)
+    {
+        if (summaries.empty())
+            summaries.resize(values.size(), Summary(m_quantiles));
+
+        VERIFY(values.size() == summaries.size());
+
+        for (unsigned d = 0; d < values.size(); ++d)
+            summaries[d].add(values[d]);
+    }
+
+    static const Summary& at(const std::vector<Summary>& summaries, unsigned d)
+    {
+        VERIFY(d < summaries.size());
+        return summaries[d];
+    }
+
+    const std::vector<Summary>& queryAt(unsigned q) const
+    {
+        VERIFY(q < m_querySummaries.size());
+        return m_querySummaries[q];
+    }
+
+    std::vector<double> m_quantiles;
+    uint64_t m_numOfSamples;
+
+    std::vector<Summary> m_summaries;
+    std::vector< ublas::vector<double> > m_queries;
+    std::vector< std::vector<Summary> > m_querySummaries;
+
+    std::vector<double> m_values;
+    ublas::vector<double> m_y;
+};
+
+
+#endif // RETENTION_POLICY_H_
@@ -0,0 +1,125 @@
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+#include <vector>
+
+#include "bayesbox/Bayes.h"
+#include "common/verify.h"
+
+
+// Resumable form of Model::MCMC() with the same configuration (data set,
+// parameter set, pool, writer, monitor, ...).  Every step() runs at most
+// maxIterations iterations and returns, so a caller (e.g. an event loop)
+// gets the thread back in bounded slices and may stop early.  getProgress()
+// and stop() may be called from any other thread at any time; the current
+// parameter values are available through Model::setSnapshotPublisher().
+class Sampler
+{
+public:
+    struct Progress
+    {
+        int iteration;
+        int numOfSamples;       // retained so far
+        double energy;          // of replica 0
+        double acceptRatio;     // of replica 0
+        bool isDone;
+    };
+
+    Sampler(Model& model, int num, int skip, int step, std::vector<IMCMCParameter*>& replicaSet)
+        : m_model(model), m_run(num, skip, step, replicaSet), m_isStarted(false), m_isStopRequested(false),
+          m_sequence(0)
+    {
+        VERIFY(!replicaSet.empty());
+
+        m_progress.iteration = 0;
+        m_progress.numOfSamples = 0;
+        m_progress.energy = 0.0;
+        m_progress.acceptRatio = 0.0;
+        m_progress.isDone = false;
+    }
+
+    // runs up to maxIterations iterations; true once the run is done
+    bool step(int maxIterations)
+    {
+        if (!m_isStarted)
+        {
+            m_model.startMCMC(m_run);
+            m_isStarted = true;
+        }
+
+        for (int n = 0; n < maxIterations && !m_run.isDone; ++n)
+        {
+            if (m_isStopRequested)
+                m_run.isDone = true;
+            else
+                m_model.iterateMCMC(m_run);
+
+            publish();
+        }
+
+        return m_run.isDone;
+    }
+
+    bool isDone() const { return m_run.isDone; }
+
+    // the next iteration of step() ends the run
+    void stop() { m_isStopRequested = true; }
+
+    // consistent copy of the state after the last iteration; never waits
+    // for step()
+    Progress getProgress() const
+    {
+        Progress progress;
+
+        for (;;)
+        {
+            unsigned sequence = m_sequence;
+            __sync_synchronize();
+
+            progress.iteration = m_progress.iteration;
+            progress.numOfSamples = m_progress.numOfSamples;
+            progress.energy = m_progress.energy;
+            progress.acceptRatio = m_progress.acceptRatio;
+            progress.isDone = m_progress.isDone;
+
+            __sync_synchronize();
+
+            if ((sequence & 0x1) == 0 && sequence == m_sequence)
+                return progress;
+        }
+    }
+
+    // the statistics MCMC() prints at the end
+    void printStatistics() { m_model.finishMCMC(m_run); }
+
+private:
+    // seqlock: odd while the fields are written
+    void publish()
+    {
+        const ReplicaStore& replicas = m_run.replicas;
+
+        m_sequence = m_sequence + 1;
+        __sync_synchronize();
+
+        m_progress.iteration = m_run.i;
+        m_progress.numOfSamples = m_run.k;
+        m_progress.energy = replicas.E[0];
+        m_progress.acceptRatio = (replicas.samplingTotalCount[0] > 0)
+            ? replicas.samplingAcceptCount[0] / replicas.samplingTotalCount[0] : 0.0;
+        m_progress.isDone = m_run.isDone;
+
+        __sync_synchronize();
+        m_sequence = m_sequence + 1;
+    }
+
+    Model& m_model;
+    Model::MCMCState m_run;
+    bool m_isStarted;
+    volatile bool m_isStopRequested;
+
+    volatile unsigned m_sequence;
+    volatile Progress m_progress;
+};
+
+
+#endif // SAMPLER_H_
@@ -0,0 +1,341 @@
+#ifndef SWEEP_H_
+#define SWEEP_H_
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "common/verify.h"
+#include "common/FileDescriptor.h"
+#include "common/OptionParser.h"
+#include "common/ThreadPool.h"
+
+
+// One point of a sweep: a value for every key of the SweepSpec.
+class RunConfig
+{
+public:
+    double get(const char* pKey, double defaultValue) const
+    {
+        for (unsigned i = 0; i < m_values.size(); ++i)
+        {
+            if (m_values[i].first == pKey)
+                return m_values[i].second;
+        }
+
+        return defaultValue;
+    }
+
+    int get(const char* pKey, int defaultValue) const
+    {
+        return static_cast<int>(floor(get(pKey, static_cast<double>(defaultValue)) + 0.5));
+    }
+
+    void set(const std::string& key, double value) { m_values.push_back(std::make_pair(key, value)); }
+
+    unsigned size() const { return m_values.size(); }
+    const std::string& getKey(unsigned i) const { return m_values[i].first; }
+    double getValue(unsigned i) const { return m_values[i].second; }
+
+private:
+    std::vector< std::pair<std::string, double> > m_values;
+};
+
+
+struct SweepResult
+{
+    SweepResult() : WAIC(0.0), Gt(0.0), Bt(0.0) {}
+
+    double WAIC;
+    double Gt;
+    double Bt;
+};
+
+
+// A run spec lists values per key and expands to their cartesian product:
+//
+//     sigma=0.1,0.2;components=2:4;seed=1:8:1
+//
+// Values are comma separated; lo:hi[:step] is an inclusive range (step 1
+// by default).  In a spec file every line holds one key=values entry and
+// '#' starts a comment.  A key may appear once.  The keys are free form,
+// typically the names of the OptionParser options of a single run (see
+// SweepOptions).
+class SweepSpec
+{
+public:
+    void parse(const char* pSpec)
+    {
+        VERIFY(pSpec != 0);
+
+        std::string spec(pSpec);
+        size_t begin = 0;
+
+        while (begin <= spec.size())
+        {
+            size_t end = spec.find_first_of(";\n", begin);
+
+            if (end == std::string::npos)
+                end = spec.size();
+
+            parseEntry(spec.substr(begin, end - begin));
+            begin = end + 1;
+        }
+    }
+
+    void parseFile(const char* pFilename)
+    {
+        FileReader file(pFilename);
+        std::string spec;
+        char line[1024];
+
+        while (fgets(line, sizeof(line), file))
+            spec += line;
+
+        parse(spec.c_str());
+    }
+
+    void add(const char* pKey, const std::vector<double>& values)
+    {
+        VERIFY(pKey != 0 && !values.empty());
+
+        for (unsigned k = 0; k < m_keys.size(); ++k)
+            VERIFY("duplicate sweep key" && m_keys[k].first != pKey);
+
+        m_keys.push_back(std::make_pair(std::string(pKey), values));
+    }
+
+    unsigned getNumOfKeys() const { return m_keys.size(); }
+    const std::string& getKey(unsigned k) const { return m_keys[k].first; }
+
+    // last key varies fastest
+    void expand(std::vector<RunConfig>& configs) const
+    {
+        configs.clear();
+
+        std::vector<size_t> stride(m_keys.size());
+        size_t num = 1;
+
+        for (unsigned k = m_keys.size(); k-- > 0; )
+        {
+            stride[k] = num;
+            num *= m_keys[k].second.size();
+        }
+
+        for (size_t n = 0; n < num; ++n)
+        {
+            RunConfig config;
+
+            for (unsigned k = 0; k < m_keys.size(); ++k)
+            {
+                const std::vector<double>& values = m_keys[k].second;
+                config.set(m_keys[k].first, values[(n / stride[k]) % values.size()]);
+            }
+
+            configs.push_back(config);
+        }
+    }
+
+private:
+    static std::string trim(const std::string& s)
+    {
+        size_t begin = s.find_first_not_of(" \t\r");
+        size_t end = s.find_last_not_of(" \t\r");
+
+        return (begin == std::string::npos) ? std::string() : s.substr(begin, end - begin + 1);
+    }
+
+    static double toDouble(const std::string& s)
+    {
+        char* pEnd = 0;
+        double v = strtod(s.c_str(), &pEnd);
+        VERIFY("invalid sweep value" && pEnd != s.c_str() && *pEnd == '\0');
+
+        return v;
+    }
+
+    void parseEntry(std::string entry)
+    {
+        size_t comment = entry.find('#');
+
+        if (comment != std::string::npos)
+            entry.erase(comment);
+
+        entry = trim(entry);
+
+        if (entry.empty())
+            return;
+
+        size_t equal = entry.find('=');
+        VERIFY("sweep entry must be key=values" && equal != std::string::npos);
+
+        std::string key = trim(entry.substr(0, equal));
+        std::string list = entry.substr(equal + 1);
+        std::vector<double> values;
+
+        VERIFY(!key.empty());
+
+        size_t begin = 0;
+
+        while (begin <= list.size())
+        {
+            size_t end = list.find(',', begin);
+
+            if (end == std::string::npos)
+                end = list.size();
+
+            std::string item = trim(list.substr(begin, end - begin));
+            size_t colon = item.find(':');
+
+            if (colon == std::string::npos)
+            {
+                values.push_back(toDouble(item));
+            }
+            else
+            {
+                size_t colon2 = item.find(':', colon + 1);
+                double lo = toDouble(trim(item.substr(0, colon)));
+                double hi = toDouble(trim(item.substr(colon + 1, colon2 == std::string::npos ? std::string::npos : colon2 - colon - 1)));
+                double step = (colon2 == std::string::npos) ? 1.0 : toDouble(trim(item.substr(colon2 + 1)));
+
+                VERIFY("sweep range needs a positive step" && step > 0.0 && hi >= lo);
+
+                unsigned num = static_cast<unsigned>(floor((hi - lo) / step + 1e-9)) + 1;
+
+                for (unsigned i = 0; i < num; ++i)
+                    values.push_back(lo + i * step);
+            }
+
+            begin = end + 1;
+        }
+
+        add(key.c_str(), values);
+    }
+
+    std::vector< std::pair<std::string, std::vector<double> > > m_keys;
+};
+
+
+// The options --sweep (a spec) and --sweep-file (a spec file) of a
+// program whose single run is configured by int and double options.
+// Created with the other options, before OptionParser::parse().  A job
+// reads the swept keys with the option values as defaults:
+//
+//     double& sigma = OptionParser::createOption(0.1, "sigma", "noise");
+//     SweepOptions sweepOptions;
+//     ...
+//     config.get("sigma", sigma)
+class SweepOptions
+{
+public:
+    SweepOptions()
+        : m_pSpec(OptionParser::createOption(static_cast<const char*>(0), "sweep", "sweep spec, key=values;...")),
+          m_pSpecFile(OptionParser::createOption(static_cast<const char*>(0), "sweep-file", "sweep spec file")) {}
+
+    bool isSweep() const { return m_pSpec != 0 || m_pSpecFile != 0; }
+
+    // the spec of both options; every key has to be an int or double option
+    void getSpec(SweepSpec& spec) const
+    {
+        if (m_pSpecFile)
+            spec.parseFile(m_pSpecFile);
+
+        if (m_pSpec)
+            spec.parse(m_pSpec);
+
+        for (unsigned k = 0; k < spec.getNumOfKeys(); ++k)
+        {
+            OptionHolder* pOption = OptionParser::findOption(spec.getKey(k).c_str());
+
+            VERIFY("sweep key is not an option" && pOption != 0);
+            VERIFY("sweep key is not a numeric option"
+                   && (dynamic_cast<OptionHolderInt*>(pOption) || dynamic_cast<OptionHolderDouble*>(pOption)));
+        }
+    }
+
+private:
+    const char*& m_pSpec;
+    const char*& m_pSpecFile;
+};
+
+
+class ISweepJob
+{
+public:
+    virtual ~ISweepJob() {}
+
+    // runs one configuration; called concurrently from the pool threads,
+    // so everything shared between runs (e.g. the data set) must be read-only
+    virtual void run(const RunConfig& config, SweepResult& result) = 0;
+};
+
+
+// Runs every configuration of a sweep in one process.  Runs are handed
+// out one at a time to whichever pool thread is free, and a run may use
+// the same pool for its own replica / data parallelism: free threads help
+// the runs already started before they start another one (the pool serves
+// the innermost job first).
+class SweepScheduler
+{
+public:
+    SweepScheduler(ThreadPool& pool) : m_pPool(&pool) {}
+
+    void run(const SweepSpec& spec, ISweepJob& job)
+    {
+        spec.expand(m_configs);
+        m_results.assign(m_configs.size(), SweepResult());
+
+        JobTask task(*this, job);
+        m_pPool->parallelFor(m_configs.size(), task);
+    }
+
+    const std::vector<RunConfig>& getConfigs() const { return m_configs; }
+    const std::vector<SweepResult>& getResults() const { return m_results; }
+
+    // one line per run: the swept values followed by WAIC, Gt and Bt
+    void printTable(FILE* fp) const
+    {
+        if (m_configs.empty())
+            return;
+
+        for (unsigned k = 0; k < m_configs[0].size(); ++k)
+            fprintf(fp, "%s ", m_configs[0].getKey(k).c_str());
+
+        fprintf(fp, "WAIC Gt Bt\n");
+
+        for (unsigned i = 0; i < m_configs.size(); ++i)
+        {
+            for (unsigned k = 0; k < m_configs[i].size(); ++k)
+                fprintf(fp, "%g ", m_configs[i].getValue(k));
+
+            fprintf(fp, "%f %f %f\n", m_results[i].WAIC, m_results[i].Gt, m_results[i].Bt);
+        }
+    }
+
+private:
+    class JobTask : public ITask
+    {
+    public:
+        JobTask(SweepScheduler& scheduler, ISweepJob& job) : m_scheduler(scheduler), m_job(job) {}
+
+        void run(unsigned index)
+        {
+            m_job.run(m_scheduler.m_configs[index], m_scheduler.m_results[index]);
+        }
+
+    private:
+        SweepScheduler& m_scheduler;
+        ISweepJob& m_job;
+    };
+
+    ThreadPool* m_pPool;
+    std::vector<RunConfig> m_configs;
+    std::vector<SweepResult> m_results;
+};
+
+
+#endif // SWEEP_H_
@@ -0,0 +1,334 @@
+#ifndef ASYNC_WRITER_H_
+#define ASYNC_WRITER_H_
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+#include <unistd.h>     // usleep()
+#include <sched.h>      // sched_yield()
+#include <pthread.h>
+
+#include "common/verify.h"
+#include "common/RingBuffer.h"
+
+
+// Hands samples and diagnostic messages to a background thread which
+// formats them into batches for fp (e.g. a FileWriter or a Logger).  The
+// calling thread only copies the record into a bounded lock-free queue.
+// Batches are double buffered: a full batch is swapped to a second thread
+// which writes it while the next one is formatted.
+//
+// Binary records are a RecordHeader followed by size bytes: size / 8
+// doubles for a sample, the message text (without '\0') for a message.
+class AsyncWriter
+{
+public:
+    enum Format
+    {
+        FORMAT_TEXT,
+        FORMAT_BINARY,
+    };
+
+    enum RecordType
+    {
+        RECORD_SAMPLE = 1,
+        RECORD_MESSAGE = 2,
+    };
+
+    struct RecordHeader
+    {
+        uint32_t type;
+        uint32_t size;
+        uint64_t iteration;
+    };
+
+    // maxRecordSize bounds one record in bytes.  When the queue is full a
+    // sample waits (yields) for room, so none is lost but the sampler may
+    // block on slow I/O; with dropWhenFull = true it is dropped instead.
+    // Messages are always dropped when the queue is full.  Dropped records
+    // are counted (getNumOfDropped()).
+    AsyncWriter(FILE* fp, Format format = FORMAT_TEXT, unsigned numOfSlots = 4096,
+                unsigned maxRecordSize = 512, bool dropWhenFull = false)
+        : m_fp(fp),
+          m_format(format),
+          m_queue(numOfSlots, sizeof(RecordHeader) + maxRecordSize),
+          m_maxRecordSize(maxRecordSize),
+          m_isDropWhenFull(dropWhenFull),
+          m_numOfPushed(0),
+          m_numOfWritten(0),
+          m_numOfDropped(0),
+          m_isTerminated(false),
+          m_isPending(false),
+          m_numOfPending(0),
+          m_isIoTerminated(false)
+    {
+        VERIFY(fp != 0);
+
+        m_batch.reserve(BATCH_SIZE + sizeof(RecordHeader) + maxRecordSize * 4);
+        m_pending.reserve(m_batch.capacity());
+
+        VERIFY(pthread_mutex_init(&m_mutex, 0) == 0);
+        VERIFY(pthread_cond_init(&m_cond, 0) == 0);
+        VERIFY(pthread_create(&m_ioThread, 0, ioEntry, this) == 0);
+        VERIFY(pthread_create(&m_thread, 0, entry, this) == 0);
+    }
+
+    ~AsyncWriter()
+    {
+        m_isTerminated = true;
+        pthread_join(m_thread, 0);
+
+        pthread_mutex_lock(&m_mutex);
+        m_isIoTerminated = true;
+        pthread_cond_broadcast(&m_cond);
+        pthread_mutex_unlock(&m_mutex);
+
+        pthread_join(m_ioThread, 0);
+
+        pthread_cond_destroy(&m_cond);
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    void writeSample(uint64_t iteration, const double* pValues, unsigned num)
+    {
+        VERIFY(num * sizeof(double) <= m_maxRecordSize);
+
+        uint8_t* p = reserve(m_isDropWhenFull);
+
+        if (!p)
+            return;
+
+        RecordHeader* pHeader = reinterpret_cast<RecordHeader*>(p);
+        pHeader->type = RECORD_SAMPLE;
+        pHeader->size = num * sizeof(double);
+        pHeader->iteration = iteration;
+        memcpy(p + sizeof(RecordHeader), pValues, pHeader->size);
+
+        commit();
+    }
+
+    void writeSample(uint64_t iteration, const std::vector<double>& values)
+    {
+        writeSample(iteration, values.empty() ? 0 : &values[0], values.size());
+    }
+
+    // printf() style; the message is truncated to the record size
+    void writeMessage(uint64_t iteration, const char* pFormat, ...)
+    {
+        uint8_t* p = reserve(true);
+
+        if (!p)
+            return;
+
+        va_list args;
+        va_start(args, pFormat);
+        int size = vsnprintf(reinterpret_cast<char*>(p + sizeof(RecordHeader)), m_maxRecordSize, pFormat, args);
+        va_end(args);
+
+        if (size < 0)
+            size = 0;
+
+        if (static_cast<unsigned>(size) >= m_maxRecordSize)
+            size = m_maxRecordSize - 1;
+
+        RecordHeader* pHeader = reinterpret_cast<RecordHeader*>(p);
+        pHeader->type = RECORD_MESSAGE;
+        pHeader->size = size;
+        pHeader->iteration = iteration;
+
+        commit();
+    }
+
+    // waits until everything written so far has reached fp
+    void flush()
+    {
+        while (m_numOfWritten != m_numOfPushed)
+            usleep(100);
+    }
+
+    uint64_t getNumOfDropped() const { return m_numOfDropped; }
+
+private:
+    static const unsigned BATCH_SIZE = 64 * 1024;
+
+    uint8_t* reserve(bool isDroppable)
+    {
+        void* p;
+
+        while (!(p = m_queue.reserve()))
+        {
+            if (isDroppable)
+            {
+                ++m_numOfDropped;
+                return 0;
+            }
+
+            sched_yield();
+        }
+
+        return static_cast<uint8_t*>(p);
+    }
+
+    void commit()
+    {
+        m_queue.commit();
+        m_numOfPushed = m_numOfPushed + 1;
+    }
+
+    void format(const uint8_t* p)
+    {
+        const RecordHeader* pHeader = reinterpret_cast<const RecordHeader*>(p);
+        const uint8_t* pPayload = p + sizeof(RecordHeader);
+
+        if (m_format == FORMAT_BINARY)
+        {
+            m_batch.insert(m_batch.end(), p, pPayload + pHeader->size);
+            return;
+        }
+
+        if (pHeader->type == RECORD_MESSAGE)
+        {
+            m_batch.insert(m_batch.end(), pPayload, pPayload + pHeader->size);
+            m_batch.push_back('\n');
+            return;
+        }
+
+        char text[32];
+        int n = snprintf(text, sizeof(text), "%llu", static_cast<unsigned long long>(pHeader->iteration));
+        m_batch.insert(m_batch.end(), text, text + n);
+
+        for (unsigned i = 0; i < pHeader->size / sizeof(double); ++i)
+        {
+            double v;
+            memcpy(&v, pPayload + i * sizeof(double), sizeof(double));
+
+            n = snprintf(text, sizeof(text), " %.15le", v);
+            m_batch.insert(m_batch.end(), text, text + n);
+        }
+
+        m_batch.push_back('\n');
+    }
+
+    // hands the current batch, numOfFormatted records up to its end, to the
+    // I/O thread once it is done with the previous one
+    void swapBatch(uint64_t numOfFormatted)
+    {
+        pthread_mutex_lock(&m_mutex);
+
+        while (m_isPending)
+            pthread_cond_wait(&m_cond, &m_mutex);
+
+        m_pending.swap(m_batch);
+        m_numOfPending = numOfFormatted;
+        m_isPending = true;
+
+        pthread_cond_broadcast(&m_cond);
+        pthread_mutex_unlock(&m_mutex);
+
+        m_batch.clear();
+    }
+
+    void writeBatches()
+    {
+        pthread_mutex_lock(&m_mutex);
+
+        for (;;)
+        {
+            while (!m_isPending && !m_isIoTerminated)
+                pthread_cond_wait(&m_cond, &m_mutex);
+
+            if (!m_isPending)
+                break;
+
+            uint64_t numOfPending = m_numOfPending;
+
+            // m_pending is not touched by the formatter while pending
+            pthread_mutex_unlock(&m_mutex);
+
+            if (!m_pending.empty())
+                VERIFY(fwrite(&m_pending[0], 1, m_pending.size(), m_fp) == m_pending.size());
+
+            fflush(m_fp);
+
+            __sync_synchronize();
+            m_numOfWritten = numOfPending;
+
+            pthread_mutex_lock(&m_mutex);
+            m_isPending = false;
+            pthread_cond_broadcast(&m_cond);
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    void work()
+    {
+        uint64_t numOfFormatted = 0;
+
+        for (;;)
+        {
+            bool isTerminated = m_isTerminated;
+            const void* p;
+
+            while ((p = m_queue.front()) != 0)
+            {
+                format(static_cast<const uint8_t*>(p));
+                m_queue.pop();
+                ++numOfFormatted;
+
+                if (m_batch.size() >= BATCH_SIZE)
+                    swapBatch(numOfFormatted);
+            }
+
+            // the rest when the queue runs dry
+            if (!m_batch.empty())
+                swapBatch(numOfFormatted);
+
+            if (isTerminated)
+                break;
+
+            usleep(1000);
+        }
+    }
+
+    static void* entry(void* p)
+    {
+        static_cast<AsyncWriter*>(p)->work();
+        return 0;
+    }
+
+    static void* ioEntry(void* p)
+    {
+        static_cast<AsyncWriter*>(p)->writeBatches();
+        return 0;
+    }
+
+    FILE* m_fp;
+    Format m_format;
+    RingBuffer m_queue;
+    unsigned m_maxRecordSize;
+    bool m_isDropWhenFull;
+
+    std::vector<uint8_t> m_batch;       // being formatted
+    std::vector<uint8_t> m_pending;     // being written
+
+    volatile uint64_t m_numOfPushed;
+    volatile uint64_t m_numOfWritten;
+    volatile uint64_t m_numOfDropped;
+    volatile bool m_isTerminated;
+
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+    bool m_isPending;
+    uint64_t m_numOfPending;
+    bool m_isIoTerminated;
+
+    pthread_t m_thread;
+    pthread_t m_ioThread;
+};
+
+
+#endif // ASYNC_WRITER_H_
@@ -10,12 +10,22 @@
 #include "common/verify.h"
 
 
+class TextObjectReader;
+
 class IFileObject
 {
 public:
     virtual ~IFileObject() {}
     virtual void writeObject(FILE* fp) = 0;
     virtual void readObject(FILE* fp) = 0;
+
+    // bulk loading (common/TextObjectReader.h), same layout as readObject(fp);
+    // named apart from readObject() so that overriding that one does not
+    // hide it
+    virtual void readTextObject(TextObjectReader& /* reader */)
+    {
+        VERIFY("object does not support TextObjectReader" && false);
+    }
 };
 
 class FileObject
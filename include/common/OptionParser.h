@@ -150,6 +150,18 @@ public:
         return p->m_value;
     }
 
+    // 0 if there is no such option
+    static OptionHolder* findOption(const char* pIdentifier)
+    {
+        for (std::vector<OptionHolder*>::iterator i = m_optionList.begin(); i != m_optionList.end(); ++i)
+        {
+            if (strcmp(pIdentifier, (*i)->m_pIdentifier) == 0)
+                return *i;
+        }
+
+        return 0;
+    }
+
     static void helpAll()
     {
         printf("Options:\n");
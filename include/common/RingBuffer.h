@@ -0,0 +1,81 @@
+#ifndef RING_BUFFER_H_
+#define RING_BUFFER_H_
+
+#include <cstddef>
+#include <cstdlib>
+#include <vector>
+#include <stdint.h>
+
+#include "common/verify.h"
+
+
+// Lock-free bounded single-producer / single-consumer queue of fixed-size
+// slots.  The producer fills reserve() and publishes it with commit(); the
+// consumer reads front() and hands the slot back with pop().  Only
+// acquire / release ordering is needed, which is free on x86.
+class RingBuffer
+{
+public:
+    RingBuffer(unsigned numOfSlots, unsigned slotSize)
+        : m_numOfSlots(1), m_slotSize((slotSize + 7) & ~7u), m_head(0), m_tail(0)
+    {
+        VERIFY(numOfSlots > 0 && slotSize > 0);
+
+        while (m_numOfSlots < numOfSlots)
+            m_numOfSlots <<= 1;
+
+        m_buffer.resize(static_cast<size_t>(m_numOfSlots) * m_slotSize);
+    }
+
+    unsigned getNumOfSlots() const { return m_numOfSlots; }
+    unsigned getSlotSize() const { return m_slotSize; }
+
+    // producer side
+
+    void* reserve()
+    {
+        if (m_head - __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE) == m_numOfSlots)
+            return 0;
+
+        return slot(m_head);
+    }
+
+    void commit()
+    {
+        __atomic_store_n(&m_head, m_head + 1, __ATOMIC_RELEASE);
+    }
+
+    // consumer side
+
+    const void* front()
+    {
+        if (m_tail == __atomic_load_n(&m_head, __ATOMIC_ACQUIRE))
+            return 0;
+
+        return slot(m_tail);
+    }
+
+    void pop()
+    {
+        __atomic_store_n(&m_tail, m_tail + 1, __ATOMIC_RELEASE);
+    }
+
+    bool isEmpty() const { return m_tail == m_head; }
+
+private:
+    void* slot(uint64_t index) { return &m_buffer[(index & (m_numOfSlots - 1)) * m_slotSize]; }
+
+    unsigned m_numOfSlots;
+    unsigned m_slotSize;
+    std::vector<uint8_t> m_buffer;
+
+    // written by one side only, kept on separate cache lines
+    char m_pad0[64];
+    volatile uint64_t m_head;
+    char m_pad1[64];
+    volatile uint64_t m_tail;
+    char m_pad2[64];
+};
+
+
+#endif // RING_BUFFER_H_
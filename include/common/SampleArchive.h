@@ -0,0 +1,463 @@
+#ifndef SAMPLE_ARCHIVE_H_
+#define SAMPLE_ARCHIVE_H_
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <sys/types.h>  // off_t
+
+#include "common/verify.h"
+#include "common/ThreadPool.h"
+
+
+// Compressed archive of the samples of one chain, each sample a row of
+// `dimension` doubles.
+//
+// Samples are grouped in blocks which are encoded independently, so they
+// can be compressed and decompressed in parallel and any range can be read
+// back through the block index at the end of the file.  Inside a block
+// every column is predicted from the previous sample:
+//  - lossless: the XOR with the previous bit pattern is stored as a tag
+//    byte (leading / trailing zero byte counts) plus the remaining bytes,
+//  - lossy (errorBound > 0): values are quantized to a grid of 2 *
+//    errorBound and the zigzag delta is stored as a varint.
+//
+// Layout: Header, blocks, BlockIndex[numOfBlocks], Footer.
+class SampleArchive
+{
+public:
+    static const uint32_t MAGIC = 0x41534242;   // "BBSA"
+    static const uint32_t VERSION = 1;
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t dimension;
+        uint32_t blockSize;
+        double errorBound;
+    };
+
+    struct BlockIndex
+    {
+        uint64_t offset;
+        uint32_t size;
+        uint32_t numOfSamples;
+    };
+
+    struct Footer
+    {
+        uint64_t indexOffset;
+        uint64_t numOfSamples;
+        uint32_t numOfBlocks;
+        uint32_t magic;
+    };
+
+    static void encodeBlock(const double* pSamples, unsigned numOfSamples, unsigned dimension,
+                            double errorBound, std::vector<uint8_t>& out)
+    {
+        out.clear();
+
+        if (errorBound > 0.0)
+        {
+            std::vector<int64_t> previous(dimension, 0);
+
+            for (unsigned i = 0; i < numOfSamples * dimension; ++i)
+            {
+                double q = floor(pSamples[i] / (2.0 * errorBound) + 0.5);
+                VERIFY(fabs(q) < 4.0e18);
+
+                int64_t value = static_cast<int64_t>(q);
+                int64_t delta = value - previous[i % dimension];
+                previous[i % dimension] = value;
+
+                uint64_t zigzag = (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63);
+
+                while (zigzag >= 0x80)
+                {
+                    out.push_back(static_cast<uint8_t>(zigzag) | 0x80);
+                    zigzag >>= 7;
+                }
+
+                out.push_back(static_cast<uint8_t>(zigzag));
+            }
+        }
+        else
+        {
+            std::vector<uint64_t> previous(dimension, 0);
+
+            for (unsigned i = 0; i < numOfSamples * dimension; ++i)
+            {
+                uint64_t bits;
+                memcpy(&bits, &pSamples[i], sizeof(bits));
+
+                uint64_t x = bits ^ previous[i % dimension];
+                previous[i % dimension] = bits;
+
+                if (x == 0)
+                {
+                    out.push_back(0);
+                    continue;
+                }
+
+                unsigned lz = __builtin_clzll(x) / 8;
+                unsigned tz = __builtin_ctzll(x) / 8;
+
+                out.push_back(static_cast<uint8_t>(0x40 | (lz << 3) | tz));
+
+                for (unsigned b = tz; b < 8 - lz; ++b)
+                    out.push_back(static_cast<uint8_t>(x >> (b * 8)));
+            }
+        }
+    }
+
+    static void decodeBlock(const uint8_t* p, unsigned size, unsigned numOfSamples, unsigned dimension,
+                            double errorBound, double* pSamples)
+    {
+        const uint8_t* pEnd = p + size;
+
+        if (errorBound > 0.0)
+        {
+            std::vector<int64_t> previous(dimension, 0);
+
+            for (unsigned i = 0; i < numOfSamples * dimension; ++i)
+            {
+                uint64_t zigzag = 0;
+                unsigned shift = 0;
+
+                for (;;)
+                {
+                    VERIFY(p < pEnd && shift < 64);
+
+                    uint8_t byte = *p++;
+                    zigzag |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                    shift += 7;
+
+                    if (!(byte & 0x80))
+                        break;
+                }
+
+                int64_t delta = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+                int64_t value = previous[i % dimension] + delta;
+                previous[i % dimension] = value;
+
+                pSamples[i] = static_cast<double>(value) * 2.0 * errorBound;
+            }
+        }
+        else
+        {
+            std::vector<uint64_t> previous(dimension, 0);
+
+            for (unsigned i = 0; i < numOfSamples * dimension; ++i)
+            {
+                VERIFY(p < pEnd);
+
+                uint8_t tag = *p++;
+                uint64_t x = 0;
+
+                if (tag != 0)
+                {
+                    VERIFY(tag & 0x40);
+
+                    unsigned lz = (tag >> 3) & 7;
+                    unsigned tz = tag & 7;
+
+                    VERIFY(lz + tz < 8 && p + (8 - lz - tz) <= pEnd);
+
+                    for (unsigned b = tz; b < 8 - lz; ++b)
+                        x |= static_cast<uint64_t>(*p++) << (b * 8);
+                }
+
+                uint64_t bits = x ^ previous[i % dimension];
+                previous[i % dimension] = bits;
+
+                memcpy(&pSamples[i], &bits, sizeof(bits));
+            }
+        }
+
+        VERIFY(p == pEnd);
+    }
+};
+
+
+// Streaming writer; blocks are compressed on the pool (if any) as soon
+// as one block per thread has been collected.
+class SampleArchiveWriter
+{
+public:
+    SampleArchiveWriter(FILE* fp, unsigned dimension, unsigned blockSize = 4096,
+                        double errorBound = 0.0, ThreadPool* pPool = 0)
+        : m_fp(fp), m_dimension(dimension), m_blockSize(blockSize), m_errorBound(errorBound),
+          m_pPool(pPool), m_numOfSamples(0), m_isClosed(false)
+    {
+        VERIFY(fp != 0 && dimension > 0 && blockSize > 0 && errorBound >= 0.0);
+
+        SampleArchive::Header header;
+        header.magic = SampleArchive::MAGIC;
+        header.version = SampleArchive::VERSION;
+        header.dimension = dimension;
+        header.blockSize = blockSize;
+        header.errorBound = errorBound;
+
+        VERIFY(fwrite(&header, sizeof(header), 1, m_fp) == 1);
+
+        m_batchSize = (pPool ? pPool->getNumOfThreads() : 1) * blockSize;
+        m_samples.reserve(static_cast<size_t>(m_batchSize) * dimension);
+    }
+
+    ~SampleArchiveWriter()
+    {
+        close();
+    }
+
+    void append(const double* pSample)
+    {
+        VERIFY(!m_isClosed);
+
+        m_samples.insert(m_samples.end(), pSample, pSample + m_dimension);
+        ++m_numOfSamples;
+
+        if (m_samples.size() == static_cast<size_t>(m_batchSize) * m_dimension)
+            writeBatch();
+    }
+
+    void append(const std::vector<double>& sample)
+    {
+        VERIFY(sample.size() == m_dimension);
+        append(&sample[0]);
+    }
+
+    // writes the remaining samples and the index; called by the destructor
+    void close()
+    {
+        if (m_isClosed)
+            return;
+
+        writeBatch();
+
+        SampleArchive::Footer footer;
+        footer.indexOffset = ftello(m_fp);
+        footer.numOfSamples = m_numOfSamples;
+        footer.numOfBlocks = m_index.size();
+        footer.magic = SampleArchive::MAGIC;
+
+        if (!m_index.empty())
+            VERIFY(fwrite(&m_index[0], sizeof(SampleArchive::BlockIndex), m_index.size(), m_fp) == m_index.size());
+
+        VERIFY(fwrite(&footer, sizeof(footer), 1, m_fp) == 1);
+        fflush(m_fp);
+
+        m_isClosed = true;
+    }
+
+private:
+    class EncodeTask : public ITask
+    {
+    public:
+        EncodeTask(SampleArchiveWriter& writer, unsigned numOfSamples)
+            : m_writer(writer), m_numOfSamples(numOfSamples) {}
+
+        void run(unsigned index)
+        {
+            unsigned first = index * m_writer.m_blockSize;
+            unsigned num = std::min(m_writer.m_blockSize, m_numOfSamples - first);
+
+            SampleArchive::encodeBlock(&m_writer.m_samples[static_cast<size_t>(first) * m_writer.m_dimension], num,
+                                       m_writer.m_dimension, m_writer.m_errorBound, m_writer.m_encoded[index]);
+        }
+
+    private:
+        SampleArchiveWriter& m_writer;
+        unsigned m_numOfSamples;
+    };
+
+    void writeBatch()
+    {
+        unsigned numOfSamples = m_samples.size() / m_dimension;
+        unsigned numOfBlocks = (numOfSamples + m_blockSize - 1) / m_blockSize;
+
+        if (numOfBlocks == 0)
+            return;
+
+        m_encoded.resize(numOfBlocks);
+
+        EncodeTask task(*this, numOfSamples);
+
+        if (m_pPool)
+        {
+            m_pPool->parallelFor(numOfBlocks, task);
+        }
+        else
+        {
+            for (unsigned i = 0; i < numOfBlocks; ++i)
+                task.run(i);
+        }
+
+        for (unsigned i = 0; i < numOfBlocks; ++i)
+        {
+            SampleArchive::BlockIndex index;
+            index.offset = ftello(m_fp);
+            index.size = m_encoded[i].size();
+            index.numOfSamples = std::min(m_blockSize, numOfSamples - i * m_blockSize);
+
+            if (index.size > 0)
+                VERIFY(fwrite(&m_encoded[i][0], 1, index.size, m_fp) == index.size);
+
+            m_index.push_back(index);
+        }
+
+        m_samples.clear();
+    }
+
+    FILE* m_fp;
+    unsigned m_dimension;
+    unsigned m_blockSize;
+    double m_errorBound;
+    ThreadPool* m_pPool;
+
+    unsigned m_batchSize;
+    uint64_t m_numOfSamples;
+    bool m_isClosed;
+
+    std::vector<double> m_samples;
+    std::vector< std::vector<uint8_t> > m_encoded;
+    std::vector<SampleArchive::BlockIndex> m_index;
+};
+
+
+// Random access reader; the blocks covering a range are read in order and
+// decompressed on the pool (if any).
+class SampleArchiveReader
+{
+public:
+    SampleArchiveReader(FILE* fp, ThreadPool* pPool = 0) : m_fp(fp), m_pPool(pPool)
+    {
+        VERIFY(fp != 0);
+
+        VERIFY(fseeko(m_fp, 0, SEEK_SET) == 0);
+        VERIFY(fread(&m_header, sizeof(m_header), 1, m_fp) == 1);
+        VERIFY(m_header.magic == SampleArchive::MAGIC && m_header.version == SampleArchive::VERSION);
+
+        VERIFY(fseeko(m_fp, -static_cast<off_t>(sizeof(m_footer)), SEEK_END) == 0);
+        VERIFY(fread(&m_footer, sizeof(m_footer), 1, m_fp) == 1);
+        VERIFY(m_footer.magic == SampleArchive::MAGIC);
+
+        m_index.resize(m_footer.numOfBlocks);
+        m_first.resize(m_footer.numOfBlocks + 1, 0);
+
+        VERIFY(fseeko(m_fp, m_footer.indexOffset, SEEK_SET) == 0);
+
+        if (!m_index.empty())
+            VERIFY(fread(&m_index[0], sizeof(SampleArchive::BlockIndex), m_index.size(), m_fp) == m_index.size());
+
+        for (unsigned i = 0; i < m_index.size(); ++i)
+            m_first[i + 1] = m_first[i] + m_index[i].numOfSamples;
+
+        VERIFY(m_first.back() == m_footer.numOfSamples);
+    }
+
+    unsigned getDimension() const { return m_header.dimension; }
+    uint64_t getNumOfSamples() const { return m_footer.numOfSamples; }
+    double getErrorBound() const { return m_header.errorBound; }
+
+    // samples [first, first + num) into pSamples (num * dimension doubles)
+    void read(uint64_t first, unsigned num, double* pSamples)
+    {
+        VERIFY(first + num <= m_footer.numOfSamples);
+
+        if (num == 0)
+            return;
+
+        unsigned firstBlock = std::upper_bound(m_first.begin(), m_first.end(), first) - m_first.begin() - 1;
+        unsigned lastBlock = std::upper_bound(m_first.begin(), m_first.end(), first + num - 1) - m_first.begin() - 1;
+        unsigned numOfBlocks = lastBlock - firstBlock + 1;
+
+        m_encoded.resize(numOfBlocks);
+        m_decoded.resize(numOfBlocks);
+
+        for (unsigned i = 0; i < numOfBlocks; ++i)
+        {
+            const SampleArchive::BlockIndex& index = m_index[firstBlock + i];
+
+            m_encoded[i].resize(index.size);
+            VERIFY(fseeko(m_fp, index.offset, SEEK_SET) == 0);
+
+            if (index.size > 0)
+                VERIFY(fread(&m_encoded[i][0], 1, index.size, m_fp) == index.size);
+        }
+
+        DecodeTask task(*this, firstBlock);
+
+        if (m_pPool)
+        {
+            m_pPool->parallelFor(numOfBlocks, task);
+        }
+        else
+        {
+            for (unsigned i = 0; i < numOfBlocks; ++i)
+                task.run(i);
+        }
+
+        unsigned dimension = m_header.dimension;
+
+        for (unsigned i = 0; i < numOfBlocks; ++i)
+        {
+            uint64_t blockFirst = m_first[firstBlock + i];
+            uint64_t begin = std::max(first, blockFirst);
+            uint64_t end = std::min(first + num, m_first[firstBlock + i + 1]);
+
+            std::copy(m_decoded[i].begin() + (begin - blockFirst) * dimension,
+                      m_decoded[i].begin() + (end - blockFirst) * dimension,
+                      pSamples + (begin - first) * dimension);
+        }
+    }
+
+    void read(uint64_t first, unsigned num, std::vector<double>& samples)
+    {
+        samples.resize(static_cast<size_t>(num) * m_header.dimension);
+
+        if (num > 0)
+            read(first, num, &samples[0]);
+    }
+
+private:
+    class DecodeTask : public ITask
+    {
+    public:
+        DecodeTask(SampleArchiveReader& reader, unsigned firstBlock)
+            : m_reader(reader), m_firstBlock(firstBlock) {}
+
+        void run(unsigned index)
+        {
+            const SampleArchive::BlockIndex& block = m_reader.m_index[m_firstBlock + index];
+            unsigned dimension = m_reader.m_header.dimension;
+
+            m_reader.m_decoded[index].resize(static_cast<size_t>(block.numOfSamples) * dimension);
+
+            SampleArchive::decodeBlock(m_reader.m_encoded[index].empty() ? 0 : &m_reader.m_encoded[index][0],
+                                       block.size, block.numOfSamples, dimension,
+                                       m_reader.m_header.errorBound, &m_reader.m_decoded[index][0]);
+        }
+
+    private:
+        SampleArchiveReader& m_reader;
+        unsigned m_firstBlock;
+    };
+
+    FILE* m_fp;
+    ThreadPool* m_pPool;
+
+    SampleArchive::Header m_header;
+    SampleArchive::Footer m_footer;
+    std::vector<SampleArchive::BlockIndex> m_index;
+    std::vector<uint64_t> m_first;      // first sample of each block
+
+    std::vector< std::vector<uint8_t> > m_encoded;
+    std::vector< std::vector<double> > m_decoded;
+};
+
+
+#endif // SAMPLE_ARCHIVE_H_
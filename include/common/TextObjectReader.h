@@ -0,0 +1,323 @@
+#ifndef TEXT_OBJECT_READER_H_
+#define TEXT_OBJECT_READER_H_
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <boost/numeric/ublas/vector.hpp>
+#include <boost/numeric/ublas/matrix.hpp>
+
+#include "common/verify.h"
+#include "common/FileObject.h"
+#include "common/ThreadPool.h"
+
+
+// Bulk loader of the text format of FileObject.  The rest of the file is
+// read at once, split into chunks at whitespace and every chunk is parsed
+// on the pool, first counting and then converting its numbers straight
+// into one contiguous array; the read*() functions then consume that array
+// in the order FileObject::readObject() would.  Malformed numbers and sizes
+// fail the same VERIFY as the stdio path.
+//
+// Numbers with a mantissa below 2^53 and a decimal exponent within +-22
+// (most of what "%.15le" writes) are converted exactly with one
+// multiplication or division; everything else goes through strtod().
+class TextObjectReader
+{
+public:
+    TextObjectReader(FILE* fp, ThreadPool* pPool = 0) : m_position(0)
+    {
+        VERIFY(fp != 0);
+
+        std::vector<char> text;
+        readAll(fp, text);
+        parse(text, pPool);
+    }
+
+    size_t size() const { return m_values.size(); }
+    bool isEnd() const { return m_position == m_values.size(); }
+
+    double readDouble()
+    {
+        VERIFY("unexpected end of text object" && m_position < m_values.size());
+        return m_values[m_position++];
+    }
+
+    unsigned readSize()
+    {
+        double size = readDouble();
+        VERIFY("invalid size in text object" && size >= 0.0 && size <= 4294967295.0 && floor(size) == size);
+
+        return static_cast<unsigned>(size);
+    }
+
+    template<typename T> void readObject(std::vector<T>& v)
+    {
+        T object;
+        IFileObject& file_object = object;
+        unsigned size = readSize();
+
+        for (unsigned i = 0; i < size; ++i)
+        {
+            file_object.readTextObject(*this);
+            v.push_back(object);
+        }
+    }
+
+    void readObject(boost::numeric::ublas::vector<double>& v)
+    {
+        unsigned size = readSize();
+        const double* p = consume(size);
+
+        v.resize(size);
+        std::copy(p, p + size, v.begin());
+    }
+
+    void readObject(boost::numeric::ublas::matrix<double>& m)
+    {
+        unsigned size1 = readSize();
+        unsigned size2 = readSize();
+        const double* p = consume(static_cast<size_t>(size1) * size2);
+
+        m.resize(size1, size2, false);
+
+        for (unsigned i = 0; i < size1; ++i)
+            for (unsigned j = 0; j < size2; ++j)
+                m(i, j) = *p++;
+    }
+
+private:
+    static const size_t READ_BLOCK_SIZE = 1 << 20;
+    static const unsigned CHUNKS_PER_THREAD = 4;
+
+    static bool isSpace(char c)
+    {
+        return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+    // the number at p; pNext is left at p if there is none
+    static double toDouble(const char* p, const char*& pNext)
+    {
+        static const double powersOf10[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        const char* q = p;
+        bool isNegative = (*q == '-');
+
+        if (*q == '-' || *q == '+')
+            ++q;
+
+        uint64_t mantissa = 0;
+        int numOfDigits = 0, exponent = 0;
+
+        for (; isDigit(*q); ++q, ++numOfDigits)
+            mantissa = mantissa * 10 + (*q - '0');
+
+        if (*q == '.')
+        {
+            for (++q; isDigit(*q); ++q, ++numOfDigits, --exponent)
+                mantissa = mantissa * 10 + (*q - '0');
+        }
+
+        if (numOfDigits > 0 && (*q == 'e' || *q == 'E'))
+        {
+            const char* r = q + 1;
+            bool isNegativeExponent = (*r == '-');
+
+            if (*r == '-' || *r == '+')
+                ++r;
+
+            if (isDigit(*r))
+            {
+                int e = 0;
+
+                for (; isDigit(*r); ++r)
+                    e = (e < 10000) ? e * 10 + (*r - '0') : e;
+
+                exponent += isNegativeExponent ? -e : e;
+                q = r;
+            }
+        }
+
+        // hex floats, inf, nan and the like are left to strtod()
+        if (numOfDigits == 0 || numOfDigits > 19 || mantissa > (static_cast<uint64_t>(1) << 53)
+            || exponent < -22 || exponent > 22 || !(*q == '\0' || isSpace(*q)))
+        {
+            char* pEnd = 0;
+            double v = strtod(p, &pEnd);
+            pNext = pEnd;
+
+            return v;
+        }
+
+        double v = static_cast<double>(mantissa);
+        v = (exponent < 0) ? v / powersOf10[-exponent] : v * powersOf10[exponent];
+        pNext = q;
+
+        return isNegative ? -v : v;
+    }
+
+    // from the current position of fp to the end, NUL terminated
+    static void readAll(FILE* fp, std::vector<char>& text)
+    {
+        off_t position = ftello(fp);
+        size_t size = 0;
+
+        if (position >= 0 && fseeko(fp, 0, SEEK_END) == 0)
+        {
+            off_t end = ftello(fp);
+            VERIFY(end >= position && fseeko(fp, position, SEEK_SET) == 0);
+
+            text.resize(static_cast<size_t>(end - position) + 1);
+            size = fread(&text[0], 1, text.size() - 1, fp);
+        }
+
+        // pipes, or a file which grew meanwhile
+        for (;;)
+        {
+            if (text.size() < size + READ_BLOCK_SIZE + 1)
+                text.resize(size + READ_BLOCK_SIZE + 1);
+
+            size_t n = fread(&text[size], 1, READ_BLOCK_SIZE, fp);
+            size += n;
+
+            if (n < READ_BLOCK_SIZE)
+                break;
+        }
+
+        VERIFY(!ferror(fp));
+
+        text.resize(size + 1);
+        text[size] = '\0';
+    }
+
+    void parse(std::vector<char>& text, ThreadPool* pPool)
+    {
+        const char* pText = &text[0];
+        size_t size = text.size() - 1;
+
+        unsigned numOfChunks = pPool ? pPool->getNumOfThreads() * CHUNKS_PER_THREAD : 1;
+        std::vector<size_t> bounds(numOfChunks + 1, size);
+
+        // never split a number
+        bounds[0] = 0;
+
+        for (unsigned k = 1; k < numOfChunks; ++k)
+        {
+            size_t bound = std::max(bounds[k - 1], size / numOfChunks * k);
+
+            while (bound < size && !isSpace(pText[bound]))
+                ++bound;
+
+            bounds[k] = bound;
+        }
+
+        std::vector<size_t> offsets(numOfChunks + 1, 0);
+        ChunkTask countTask(pText, bounds, 0);
+        run(countTask, numOfChunks, pPool);
+
+        for (unsigned k = 0; k < numOfChunks; ++k)
+            offsets[k + 1] = offsets[k] + countTask.getCount(k);
+
+        m_values.resize(offsets[numOfChunks]);
+
+        if (m_values.empty())
+            return;
+
+        ChunkTask parseTask(pText, bounds, &m_values[0], &offsets);
+        run(parseTask, numOfChunks, pPool);
+    }
+
+    static void run(ITask& task, unsigned num, ThreadPool* pPool)
+    {
+        if (pPool)
+        {
+            pPool->parallelFor(num, task);
+        }
+        else
+        {
+            for (unsigned i = 0; i < num; ++i)
+                task.run(i);
+        }
+    }
+
+    const double* consume(size_t num)
+    {
+        VERIFY("unexpected end of text object" && num <= m_values.size() - m_position);
+
+        const double* p = m_values.empty() ? 0 : &m_values[m_position];
+        m_position += num;
+
+        return p;
+    }
+
+    // counts the numbers of a chunk (pValues = 0) or converts them to
+    // pValues + offsets[chunk]
+    class ChunkTask : public ITask
+    {
+    public:
+        ChunkTask(const char* pText, const std::vector<size_t>& bounds, double* pValues,
+                  const std::vector<size_t>* pOffsets = 0)
+            : m_pText(pText), m_bounds(bounds), m_pValues(pValues), m_pOffsets(pOffsets),
+              m_counts(bounds.size() - 1, 0) {}
+
+        size_t getCount(unsigned chunk) const { return m_counts[chunk]; }
+
+        void run(unsigned index)
+        {
+            const char* p = m_pText + m_bounds[index];
+            const char* pEnd = m_pText + m_bounds[index + 1];
+            double* pOut = m_pValues ? m_pValues + (*m_pOffsets)[index] : 0;
+            size_t count = 0;
+
+            for (;;)
+            {
+                while (p < pEnd && isSpace(*p))
+                    ++p;
+
+                if (p >= pEnd)
+                    break;
+
+                if (pOut)
+                {
+                    const char* pNext = 0;
+                    *pOut++ = toDouble(p, pNext);
+
+                    VERIFY("invalid number in text object" && pNext != p && pNext <= pEnd && (pNext == pEnd || isSpace(*pNext)));
+                    p = pNext;
+                }
+                else
+                {
+                    while (p < pEnd && !isSpace(*p))
+                        ++p;
+                }
+
+                ++count;
+            }
+
+            m_counts[index] = count;
+        }
+
+    private:
+        const char* m_pText;
+        const std::vector<size_t>& m_bounds;
+        double* m_pValues;
+        const std::vector<size_t>* m_pOffsets;
+        std::vector<size_t> m_counts;
+    };
+
+    std::vector<double> m_values;
+    size_t m_position;
+};
+
+
+#endif // TEXT_OBJECT_READER_H_
@@ -0,0 +1,190 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <cstdlib>
+#include <vector>
+#include <unistd.h>     // sysconf()
+#include <pthread.h>
+
+#include "common/verify.h"
+
+
+class ITask
+{
+public:
+    virtual ~ITask() {}
+    virtual void run(unsigned index) = 0;
+};
+
+
+// Persistent pool of worker threads.  parallelFor() hands out the indices
+// [0, num) one by one; the calling thread works on its own job as well and
+// only waits for indices that are already running on other threads, so a
+// task may call parallelFor() again on the same pool (e.g. replicas -> data).
+// Free threads take the most recently started job first, so such a nested
+// job gets help before more indices of the outer one are started, and a
+// caller whose indices are all taken helps the jobs started after its own
+// while it waits.
+class ThreadPool
+{
+public:
+    ThreadPool(unsigned numOfThreads = 0) : m_isTerminated(false)
+    {
+        if (numOfThreads == 0)
+        {
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            numOfThreads = (n > 0) ? static_cast<unsigned>(n) : 1;
+        }
+
+        VERIFY(pthread_mutex_init(&m_mutex, 0) == 0);
+        VERIFY(pthread_cond_init(&m_workCond, 0) == 0);
+        VERIFY(pthread_cond_init(&m_doneCond, 0) == 0);
+
+        // the caller of parallelFor() is the remaining thread
+        m_threads.resize(numOfThreads - 1);
+
+        for (unsigned i = 0; i < m_threads.size(); ++i)
+            VERIFY(pthread_create(&m_threads[i], 0, entry, this) == 0);
+    }
+
+    ~ThreadPool()
+    {
+        pthread_mutex_lock(&m_mutex);
+        m_isTerminated = true;
+        pthread_cond_broadcast(&m_workCond);
+        pthread_mutex_unlock(&m_mutex);
+
+        for (unsigned i = 0; i < m_threads.size(); ++i)
+            pthread_join(m_threads[i], 0);
+
+        pthread_cond_destroy(&m_doneCond);
+        pthread_cond_destroy(&m_workCond);
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    unsigned getNumOfThreads() const { return m_threads.size() + 1; }
+
+    void parallelFor(unsigned num, ITask& task)
+    {
+        if (num == 0)
+            return;
+
+        if (num == 1 || m_threads.empty())
+        {
+            for (unsigned i = 0; i < num; ++i)
+                task.run(i);
+
+            return;
+        }
+
+        Job job;
+        job.pTask = &task;
+        job.num = num;
+        job.next = 0;
+        job.done = 0;
+
+        pthread_mutex_lock(&m_mutex);
+        m_jobs.push_back(&job);
+        pthread_cond_broadcast(&m_workCond);
+        pthread_cond_broadcast(&m_doneCond);
+
+        while (job.next < job.num)
+            runOne(&job);
+
+        while (job.done < job.num)
+        {
+            Job* pJob = findJob(&job);
+
+            if (pJob)
+                runOne(pJob);
+            else
+                pthread_cond_wait(&m_doneCond, &m_mutex);
+        }
+
+        for (std::vector<Job*>::iterator i = m_jobs.begin(); i != m_jobs.end(); ++i)
+        {
+            if (*i == &job)
+            {
+                m_jobs.erase(i);
+                break;
+            }
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+private:
+    struct Job
+    {
+        ITask* pTask;
+        unsigned num;
+        unsigned next;
+        unsigned done;
+    };
+
+    // called and returns with m_mutex locked
+    void runOne(Job* pJob)
+    {
+        unsigned index = pJob->next++;
+
+        pthread_mutex_unlock(&m_mutex);
+        pJob->pTask->run(index);
+        pthread_mutex_lock(&m_mutex);
+
+        if (++pJob->done == pJob->num)
+            pthread_cond_broadcast(&m_doneCond);
+    }
+
+    // innermost (last started) job with indices left, among those started
+    // after pAfter if given
+    Job* findJob(const Job* pAfter = 0)
+    {
+        for (std::vector<Job*>::reverse_iterator i = m_jobs.rbegin(); i != m_jobs.rend() && *i != pAfter; ++i)
+        {
+            if ((*i)->next < (*i)->num)
+                return *i;
+        }
+
+        return 0;
+    }
+
+    void work()
+    {
+        pthread_mutex_lock(&m_mutex);
+
+        for (;;)
+        {
+            Job* pJob = findJob();
+
+            if (pJob)
+            {
+                runOne(pJob);
+                continue;
+            }
+
+            if (m_isTerminated)
+                break;
+
+            pthread_cond_wait(&m_workCond, &m_mutex);
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    static void* entry(void* p)
+    {
+        static_cast<ThreadPool*>(p)->work();
+        return 0;
+    }
+
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_workCond;
+    pthread_cond_t m_doneCond;
+
+    std::vector<pthread_t> m_threads;
+    std::vector<Job*> m_jobs;
+    bool m_isTerminated;
+};
+
+
+#endif // THREAD_POOL_H_
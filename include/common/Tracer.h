@@ -0,0 +1,253 @@
+#ifndef TRACER_H_
+#define TRACER_H_
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+#include <unistd.h>     // usleep()
+#include <pthread.h>
+
+#include "common/verify.h"
+#include "common/RingBuffer.h"
+
+
+// one traced event, also the record of the binary log
+struct TraceEvent
+{
+    enum Type
+    {
+        TYPE_SAMPLING = 1,      // proposed / current energy of a replica
+        TYPE_EXCHANGE = 2,      // H of replica + 1 / H of replica
+    };
+
+    enum Flag
+    {
+        FLAG_ACCEPTED = 0x1,
+        FLAG_SCREENED = 0x2,    // passed the first stage of delayed acceptance
+    };
+
+    uint64_t iteration;
+    uint32_t replica;
+    uint16_t thread;
+    uint8_t type;
+    uint8_t flags;
+    double proposed;
+    double current;
+};
+
+
+// Post-mortem tracing of sampler runs.  Every recording thread gets its
+// own lock-free ring on first use, so trace() is a handful of stores and
+// never blocks; when a ring is full the event is dropped and counted.  A
+// background thread drains the rings into fp as a TRACE_MAGIC header
+// followed by TraceEvent records, which decode() turns into CSV.
+class Tracer
+{
+public:
+    Tracer(FILE* fp, unsigned numOfSlots = 64 * 1024, unsigned maxNumOfThreads = 256)
+        : m_fp(fp), m_numOfSlots(numOfSlots), m_rings(maxNumOfThreads, 0), m_numOfRings(0),
+          m_numOfCycles(0), m_isTerminated(false)
+    {
+        VERIFY(fp != 0 && maxNumOfThreads > 0 && maxNumOfThreads <= 65536);
+
+        uint64_t magic = TRACE_MAGIC;
+        VERIFY(fwrite(&magic, sizeof(magic), 1, m_fp) == 1);
+
+        VERIFY(pthread_key_create(&m_key, 0) == 0);
+        VERIFY(pthread_mutex_init(&m_mutex, 0) == 0);
+        VERIFY(pthread_create(&m_thread, 0, entry, this) == 0);
+    }
+
+    ~Tracer()
+    {
+        m_isTerminated = true;
+        pthread_join(m_thread, 0);
+
+        pthread_key_delete(m_key);
+        pthread_mutex_destroy(&m_mutex);
+
+        for (unsigned i = 0; i < m_numOfRings; ++i)
+            delete m_rings[i];
+    }
+
+    void trace(uint64_t iteration, unsigned replica, TraceEvent::Type type, unsigned flags,
+               double proposed, double current)
+    {
+        Ring* pRing = static_cast<Ring*>(pthread_getspecific(m_key));
+
+        if (!pRing)
+            pRing = registerThread();
+
+        TraceEvent* pEvent = static_cast<TraceEvent*>(pRing->queue.reserve());
+
+        if (!pEvent)
+        {
+            pRing->numOfDropped = pRing->numOfDropped + 1;
+            return;
+        }
+
+        pEvent->iteration = iteration;
+        pEvent->replica = replica;
+        pEvent->thread = pRing->thread;
+        pEvent->type = type;
+        pEvent->flags = flags;
+        pEvent->proposed = proposed;
+        pEvent->current = current;
+
+        pRing->queue.commit();
+    }
+
+    // waits until everything traced so far has reached fp: the second
+    // drain cycle to end from now started after this call
+    void flush()
+    {
+        uint64_t cycle = m_numOfCycles;
+
+        while (m_numOfCycles < cycle + 2)
+            usleep(100);
+    }
+
+    uint64_t getNumOfDropped() const
+    {
+        uint64_t num = 0;
+
+        for (unsigned i = 0; i < m_numOfRings; ++i)
+            num += m_rings[i]->numOfDropped;
+
+        return num;
+    }
+
+    // binary log to CSV, one line per event in log order; returns the
+    // number of events
+    static uint64_t decode(FILE* in, FILE* out)
+    {
+        uint64_t magic = 0;
+
+        VERIFY(in != 0 && out != 0);
+        VERIFY("not a trace log" && fread(&magic, sizeof(magic), 1, in) == 1 && magic == TRACE_MAGIC);
+
+        fprintf(out, "thread,replica,iteration,type,accepted,screened,proposed,current\n");
+
+        TraceEvent event;
+        uint64_t num = 0;
+
+        while (fread(&event, sizeof(event), 1, in) == 1)
+        {
+            fprintf(out, "%u,%u,%llu,%s,%d,%d,%.15le,%.15le\n", event.thread, event.replica,
+                    static_cast<unsigned long long>(event.iteration),
+                    event.type == TraceEvent::TYPE_EXCHANGE ? "exchange" : "sampling",
+                    (event.flags & TraceEvent::FLAG_ACCEPTED) ? 1 : 0,
+                    (event.flags & TraceEvent::FLAG_SCREENED) ? 1 : 0,
+                    event.proposed, event.current);
+            ++num;
+        }
+
+        return num;
+    }
+
+private:
+    // "BBTRACE" and the record format version, little endian
+    static const uint64_t TRACE_MAGIC = 0x0145434152544242ULL;
+    static const unsigned BATCH_SIZE = 4096;
+
+    struct Ring
+    {
+        Ring(unsigned numOfSlots, unsigned thread) : queue(numOfSlots, sizeof(TraceEvent)), thread(thread), numOfDropped(0) {}
+
+        RingBuffer queue;
+        unsigned thread;
+        volatile uint64_t numOfDropped;     // written by the owning thread only
+    };
+
+    Ring* registerThread()
+    {
+        pthread_mutex_lock(&m_mutex);
+
+        unsigned thread = m_numOfRings;
+        VERIFY("too many tracing threads" && thread < m_rings.size());
+
+        Ring* pRing = new Ring(m_numOfSlots, thread);
+        m_rings[thread] = pRing;
+
+        __sync_synchronize();
+        m_numOfRings = thread + 1;
+
+        pthread_mutex_unlock(&m_mutex);
+
+        VERIFY(pthread_setspecific(m_key, pRing) == 0);
+
+        return pRing;
+    }
+
+    void work()
+    {
+        std::vector<TraceEvent> batch;
+        batch.reserve(BATCH_SIZE);
+
+        for (;;)
+        {
+            bool isTerminated = m_isTerminated;
+            unsigned numOfRings = m_numOfRings;
+
+            __sync_synchronize();
+
+            for (unsigned i = 0; i < numOfRings; ++i)
+            {
+                RingBuffer& queue = m_rings[i]->queue;
+                const void* p;
+
+                while ((p = queue.front()) != 0)
+                {
+                    batch.push_back(*static_cast<const TraceEvent*>(p));
+                    queue.pop();
+
+                    if (batch.size() == BATCH_SIZE)
+                        writeBatch(batch);
+                }
+            }
+
+            if (!batch.empty())
+                writeBatch(batch);
+
+            __sync_synchronize();
+            m_numOfCycles = m_numOfCycles + 1;
+
+            if (isTerminated)
+                break;
+
+            usleep(1000);
+        }
+    }
+
+    void writeBatch(std::vector<TraceEvent>& batch)
+    {
+        VERIFY(fwrite(&batch[0], sizeof(TraceEvent), batch.size(), m_fp) == batch.size());
+        fflush(m_fp);
+
+        batch.clear();
+    }
+
+    static void* entry(void* p)
+    {
+        static_cast<Tracer*>(p)->work();
+        return 0;
+    }
+
+    FILE* m_fp;
+    unsigned m_numOfSlots;
+
+    pthread_key_t m_key;
+    pthread_mutex_t m_mutex;
+    std::vector<Ring*> m_rings;
+    volatile unsigned m_numOfRings;
+
+    volatile uint64_t m_numOfCycles;
+    volatile bool m_isTerminated;
+
+    pthread_t m_thread;
+};
+
+
+#endif // TRACER_H_
@@ -0,0 +1,346 @@
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>    // TCP_NODELAY
+
+#include "common/verify.h"
+
+
+// Reliable, ordered byte stream between two processes.
+class ITransport
+{
+public:
+    virtual ~ITransport() {}
+    virtual void send(const void* p, size_t size) = 0;
+    virtual void recv(void* p, size_t size) = 0;
+};
+
+
+// Explicitly serialized fields, sent framed by a header of magic, protocol
+// version and payload size.  Everything is big endian (network order);
+// doubles are sent as their IEEE 754 bits, so peers may differ in
+// endianness and struct layout but not in the protocol version.
+class Message
+{
+public:
+    static const uint32_t MAGIC = 0x42424d53;       // "BBMS"
+    static const uint32_t VERSION = 1;
+    static const uint32_t MAX_SIZE = 1u << 30;
+
+    Message() : m_position(0) {}
+
+    void clear()
+    {
+        m_payload.clear();
+        m_position = 0;
+    }
+
+    // all fields read
+    bool isEnd() const { return m_position == m_payload.size(); }
+
+    void putUint32(uint32_t v)
+    {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            m_payload.push_back(static_cast<unsigned char>(v >> shift));
+    }
+
+    void putUint64(uint64_t v)
+    {
+        putUint32(static_cast<uint32_t>(v >> 32));
+        putUint32(static_cast<uint32_t>(v));
+    }
+
+    void putDouble(double v)
+    {
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        putUint64(bits);
+    }
+
+    uint32_t getUint32()
+    {
+        VERIFY("truncated message" && m_position + 4 <= m_payload.size());
+
+        uint32_t v = decode(&m_payload[m_position]);
+        m_position += 4;
+
+        return v;
+    }
+
+    uint64_t getUint64()
+    {
+        uint64_t high = getUint32();
+        return (high << 32) | getUint32();
+    }
+
+    double getDouble()
+    {
+        uint64_t bits = getUint64();
+        double v;
+        memcpy(&v, &bits, sizeof(v));
+
+        return v;
+    }
+
+    void send(ITransport& transport) const
+    {
+        VERIFY(m_payload.size() <= MAX_SIZE);
+
+        unsigned char header[HEADER_SIZE];
+        encode(MAGIC, header);
+        encode(VERSION, header + 4);
+        encode(m_payload.size(), header + 8);
+
+        transport.send(header, sizeof(header));
+
+        if (!m_payload.empty())
+            transport.send(&m_payload[0], m_payload.size());
+    }
+
+    void recv(ITransport& transport)
+    {
+        unsigned char header[HEADER_SIZE];
+        transport.recv(header, sizeof(header));
+
+        VERIFY("not a message" && decode(header) == MAGIC);
+        VERIFY("protocol version mismatch" && decode(header + 4) == VERSION);
+
+        uint32_t size = decode(header + 8);
+        VERIFY(size <= MAX_SIZE);
+
+        m_payload.resize(size);
+        m_position = 0;
+
+        if (size > 0)
+            transport.recv(&m_payload[0], size);
+    }
+
+private:
+    static const unsigned HEADER_SIZE = 12;
+
+    static void encode(uint32_t v, unsigned char* p)
+    {
+        p[0] = static_cast<unsigned char>(v >> 24);
+        p[1] = static_cast<unsigned char>(v >> 16);
+        p[2] = static_cast<unsigned char>(v >> 8);
+        p[3] = static_cast<unsigned char>(v);
+    }
+
+    static uint32_t decode(const unsigned char* p)
+    {
+        return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16)
+            | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+    }
+
+    std::vector<unsigned char> m_payload;
+    size_t m_position;
+};
+
+
+// Stream socket transport: Unix domain sockets on one host, TCP between
+// hosts.  The factories return objects owned by the caller.
+class SocketTransport : public ITransport
+{
+public:
+    SocketTransport(int fd) : m_fd(fd)
+    {
+        VERIFY(fd >= 0);
+    }
+
+    ~SocketTransport()
+    {
+        close(m_fd);
+    }
+
+    void send(const void* p, size_t size)
+    {
+        const char* pData = static_cast<const char*>(p);
+
+        while (size > 0)
+        {
+            ssize_t n = ::send(m_fd, pData, size, MSG_NOSIGNAL);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            VERIFY(n > 0);
+
+            pData += n;
+            size -= n;
+        }
+    }
+
+    void recv(void* p, size_t size)
+    {
+        char* pData = static_cast<char*>(p);
+
+        while (size > 0)
+        {
+            ssize_t n = ::recv(m_fd, pData, size, 0);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            VERIFY("peer closed the connection" && n > 0);
+
+            pData += n;
+            size -= n;
+        }
+    }
+
+    // connected pair, e.g. to be shared with a fork()ed child
+    static void createPair(SocketTransport*& pFirst, SocketTransport*& pSecond)
+    {
+        int fd[2];
+        VERIFY(socketpair(AF_UNIX, SOCK_STREAM, 0, fd) == 0);
+
+        pFirst = new SocketTransport(fd[0]);
+        pSecond = new SocketTransport(fd[1]);
+    }
+
+    static SocketTransport* connectUnix(const char* pPath)
+    {
+        sockaddr_un addr;
+        initUnixAddress(addr, pPath);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        VERIFY(fd >= 0);
+
+        // the listener may not be up yet
+        for (int retry = 0; connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0; ++retry)
+        {
+            VERIFY(retry < 100);
+            usleep(100 * 1000);
+        }
+
+        return new SocketTransport(fd);
+    }
+
+    // accepts num connections on pPath
+    static void listenUnix(const char* pPath, unsigned num, std::vector<ITransport*>& transports)
+    {
+        sockaddr_un addr;
+        initUnixAddress(addr, pPath);
+        unlink(pPath);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        VERIFY(fd >= 0);
+        VERIFY(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+
+        acceptAll(fd, num, transports, false);
+        unlink(pPath);
+    }
+
+    static SocketTransport* connectTcp(const char* pHost, unsigned short port)
+    {
+        VERIFY(pHost != 0);
+
+        char service[16];
+        snprintf(service, sizeof(service), "%u", port);
+
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        for (int retry = 0; ; ++retry)
+        {
+            addrinfo* pResult = 0;
+            VERIFY(getaddrinfo(pHost, service, &hints, &pResult) == 0);
+
+            for (addrinfo* p = pResult; p; p = p->ai_next)
+            {
+                int fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+
+                if (fd < 0)
+                    continue;
+
+                if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+                {
+                    freeaddrinfo(pResult);
+                    setNoDelay(fd);
+                    return new SocketTransport(fd);
+                }
+
+                close(fd);
+            }
+
+            freeaddrinfo(pResult);
+
+            VERIFY(retry < 100);
+            usleep(100 * 1000);
+        }
+    }
+
+    // accepts num connections on port (all interfaces)
+    static void listenTcp(unsigned short port, unsigned num, std::vector<ITransport*>& transports)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        VERIFY(fd >= 0);
+
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+
+        VERIFY(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+
+        acceptAll(fd, num, transports, true);
+    }
+
+private:
+    static void initUnixAddress(sockaddr_un& addr, const char* pPath)
+    {
+        VERIFY(pPath != 0 && strlen(pPath) < sizeof(addr.sun_path));
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, pPath);
+    }
+
+    static void setNoDelay(int fd)
+    {
+        // exchange messages are tiny and latency bound
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    static void acceptAll(int fd, unsigned num, std::vector<ITransport*>& transports, bool isTcp)
+    {
+        VERIFY(listen(fd, num) == 0);
+
+        for (unsigned i = 0; i < num; ++i)
+        {
+            int connection = accept(fd, 0, 0);
+            VERIFY(connection >= 0);
+
+            if (isTcp)
+                setNoDelay(connection);
+
+            transports.push_back(new SocketTransport(connection));
+        }
+
+        close(fd);
+    }
+
+    int m_fd;
+};
+
+
+#endif // TRANSPORT_H_
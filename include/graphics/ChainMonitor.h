@@ -0,0 +1,288 @@
+#ifndef CHAIN_MONITOR_H_
+#define CHAIN_MONITOR_H_
+
+#include <stdint.h>
+#include <unistd.h>     // usleep()
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+
+#include "common/verify.h"
+#include "bayesbox/ChainSnapshot.h"
+#include "graphics/FrameBuffer.h"
+
+// Live view of a running Model::MCMC: trace plots and histograms of the
+// recent history of every parameter value, and the energy of each replica.
+// Snapshots are taken from a SnapshotPublisher, so the sampler is never
+// stalled by rendering.  Works with XFrameBuffer or, headless, with
+// PpmFrameBuffer.
+class ChainMonitor
+{
+private:
+    static const uint32_t BACKGROUND_COLOR = 0x000000;
+    static const uint32_t GRID_COLOR = 0x404040;
+    static const uint32_t TRACE_COLOR = 0x00ff00;
+    static const uint32_t HISTOGRAM_COLOR = 0x4080ff;
+    static const uint32_t ENERGY_COLOR = 0xff8000;
+    static const unsigned MAX_ROWS = 16;
+
+    SnapshotPublisher* m_pPublisher;
+    IFrameBuffer* m_pFrameBuffer;
+
+    unsigned m_historyLength;
+    unsigned m_numOfBins;
+
+    std::vector< std::vector<double> > m_history;   // [value][ring index]
+    unsigned m_historyHead;
+    unsigned m_historyCount;
+
+    std::vector<double> m_energies;
+    std::vector<unsigned> m_bins;
+
+    pthread_mutex_t m_mutex;    // update() from the render thread and callers
+    pthread_t m_thread;
+    bool m_isRunning;
+    volatile bool m_isTerminated;
+    unsigned m_interval;
+
+public:
+    ChainMonitor(SnapshotPublisher& publisher, IFrameBuffer& frameBuffer,
+                 unsigned historyLength = 512, unsigned numOfBins = 64)
+        : m_pPublisher(&publisher),
+          m_pFrameBuffer(&frameBuffer),
+          m_historyLength(historyLength),
+          m_numOfBins(numOfBins),
+          m_historyHead(0),
+          m_historyCount(0),
+          m_bins(numOfBins),
+          m_isRunning(false),
+          m_isTerminated(false),
+          m_interval(0)
+    {
+        VERIFY(historyLength > 1 && numOfBins > 0);
+        VERIFY(frameBuffer.getBpp() == 4);
+        VERIFY(pthread_mutex_init(&m_mutex, 0) == 0);
+    }
+
+    ~ChainMonitor()
+    {
+        stop();
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    // renders on its own thread, polling for a new snapshot every
+    // interval microseconds
+    void start(unsigned interval = 33333)
+    {
+        VERIFY(!m_isRunning);
+
+        m_interval = interval;
+        m_isTerminated = false;
+
+        VERIFY(pthread_create(&m_thread, 0, entry, this) == 0);
+        m_isRunning = true;
+    }
+
+    void stop()
+    {
+        if (m_isRunning)
+        {
+            m_isTerminated = true;
+            pthread_join(m_thread, 0);
+            m_isRunning = false;
+        }
+    }
+
+    // renders and presents one frame if a new snapshot is available; may
+    // be called while the render thread runs
+    bool update()
+    {
+        pthread_mutex_lock(&m_mutex);
+
+        const ChainSnapshot* pSnapshot = m_pPublisher->acquire();
+
+        if (pSnapshot)
+        {
+            append(*pSnapshot);
+            render();
+            m_pFrameBuffer->flip();
+        }
+
+        pthread_mutex_unlock(&m_mutex);
+
+        return pSnapshot != 0;
+    }
+
+private:
+    static void* entry(void* p)
+    {
+        ChainMonitor* pThis = static_cast<ChainMonitor*>(p);
+
+        while (!pThis->m_isTerminated)
+        {
+            pThis->update();
+            usleep(pThis->m_interval);
+        }
+
+        return 0;
+    }
+
+    void append(const ChainSnapshot& snapshot)
+    {
+        if (m_history.size() != snapshot.values.size())
+        {
+            m_history.assign(snapshot.values.size(), std::vector<double>(m_historyLength));
+            m_historyHead = 0;
+            m_historyCount = 0;
+        }
+
+        for (unsigned i = 0; i < snapshot.values.size(); ++i)
+            m_history[i][m_historyHead] = snapshot.values[i];
+
+        m_historyHead = (m_historyHead + 1) % m_historyLength;
+        m_historyCount = std::min(m_historyCount + 1, m_historyLength);
+
+        m_energies = snapshot.energies;
+    }
+
+    // i-th oldest entry of the history of value index
+    double history(unsigned index, unsigned i) const
+    {
+        unsigned first = (m_historyHead + m_historyLength - m_historyCount) % m_historyLength;
+        return m_history[index][(first + i) % m_historyLength];
+    }
+
+    void range(unsigned index, double& lo, double& hi) const
+    {
+        lo = hi = history(index, 0);
+
+        for (unsigned i = 1; i < m_historyCount; ++i)
+        {
+            double v = history(index, i);
+            lo = std::min(lo, v);
+            hi = std::max(hi, v);
+        }
+
+        if (hi - lo < 1e-12)
+        {
+            lo -= 0.5;
+            hi += 0.5;
+        }
+    }
+
+    void fillRect(int x, int y, int w, int h, uint32_t color)
+    {
+        int x0 = std::max(x, 0), x1 = std::min<int>(x + w, m_pFrameBuffer->getWidth());
+        int y0 = std::max(y, 0), y1 = std::min<int>(y + h, m_pFrameBuffer->getHeight());
+
+        for (int j = y0; j < y1; ++j)
+        {
+            uint32_t* p = reinterpret_cast<uint32_t*>(m_pFrameBuffer->getBuffer(0, j));
+            std::fill(p + x0, p + std::max(x0, x1), color);
+        }
+    }
+
+    void plotTrace(unsigned index, int x, int y, int w, int h)
+    {
+        double lo, hi;
+        range(index, lo, hi);
+
+        int prev = -1;
+
+        for (int c = 0; c < w; ++c)
+        {
+            unsigned i = static_cast<unsigned>(static_cast<uint64_t>(c) * m_historyCount / w);
+            int v = h - 1 - static_cast<int>((history(index, i) - lo) / (hi - lo) * (h - 1));
+
+            if (prev < 0)
+                prev = v;
+
+            // vertical span joining the previous column keeps the line connected
+            fillRect(x + c, y + std::min(prev, v), 1, std::abs(v - prev) + 1, TRACE_COLOR);
+            prev = v;
+        }
+    }
+
+    void plotHistogram(unsigned index, int x, int y, int w, int h)
+    {
+        double lo, hi;
+        range(index, lo, hi);
+
+        std::fill(m_bins.begin(), m_bins.end(), 0);
+
+        for (unsigned i = 0; i < m_historyCount; ++i)
+        {
+            unsigned b = static_cast<unsigned>((history(index, i) - lo) / (hi - lo) * m_numOfBins);
+            ++m_bins[std::min(b, m_numOfBins - 1)];
+        }
+
+        unsigned maxCount = *std::max_element(m_bins.begin(), m_bins.end());
+
+        for (unsigned b = 0; b < m_numOfBins; ++b)
+        {
+            int bx0 = x + b * w / m_numOfBins;
+            int bx1 = x + (b + 1) * w / m_numOfBins;
+            int bh = static_cast<int>(static_cast<uint64_t>(m_bins[b]) * h / maxCount);
+
+            fillRect(bx0, y + h - bh, std::max(bx1 - bx0 - 1, 1), bh, HISTOGRAM_COLOR);
+        }
+    }
+
+    void plotEnergies(int x, int y, int w, int h)
+    {
+        if (m_energies.empty())
+            return;
+
+        double lo = *std::min_element(m_energies.begin(), m_energies.end());
+        double hi = *std::max_element(m_energies.begin(), m_energies.end());
+
+        if (hi - lo < 1e-12)
+            hi = lo + 1.0;
+
+        int numOfReplica = m_energies.size();
+
+        for (int l = 0; l < numOfReplica; ++l)
+        {
+            int by0 = y + l * h / numOfReplica;
+            int by1 = y + (l + 1) * h / numOfReplica;
+            int bw = 1 + static_cast<int>((m_energies[l] - lo) / (hi - lo) * (w - 1));
+
+            fillRect(x, by0, bw, std::max(by1 - by0 - 1, 1), ENERGY_COLOR);
+        }
+    }
+
+    void render()
+    {
+        int width = m_pFrameBuffer->getWidth();
+        int height = m_pFrameBuffer->getHeight();
+
+        fillRect(0, 0, width, height, BACKGROUND_COLOR);
+
+        int traceWidth = width / 2;
+        int histogramWidth = width * 3 / 10;
+        int energyX = traceWidth + histogramWidth;
+
+        unsigned numOfRows = (m_history.size() < MAX_ROWS) ? m_history.size() : MAX_ROWS;
+
+        for (unsigned r = 0; r < numOfRows; ++r)
+        {
+            int y0 = r * height / numOfRows;
+            int h = (r + 1) * height / numOfRows - y0;
+
+            fillRect(0, y0 + h - 1, energyX, 1, GRID_COLOR);
+
+            if (h > 3 && m_historyCount > 0)
+            {
+                plotTrace(r, 0, y0 + 1, traceWidth - 2, h - 3);
+                plotHistogram(r, traceWidth, y0 + 1, histogramWidth - 2, h - 3);
+            }
+        }
+
+        fillRect(traceWidth - 1, 0, 1, height, GRID_COLOR);
+        fillRect(energyX - 1, 0, 1, height, GRID_COLOR);
+
+        plotEnergies(energyX + 1, 0, width - energyX - 2, height);
+    }
+};
+
+#endif // CHAIN_MONITOR_H_
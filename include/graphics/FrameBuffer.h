@@ -0,0 +1,20 @@
+#ifndef FRAME_BUFFER_H_
+#define FRAME_BUFFER_H_
+
+#include <stdint.h>
+
+
+// 32bpp frame buffer; a pixel is 0x00RRGGBB in host byte order.
+class IFrameBuffer
+{
+public:
+    virtual ~IFrameBuffer() {}
+    virtual void flip() = 0;
+
+    virtual uint8_t* getBuffer(uint32_t x = 0, uint32_t y = 0) = 0;
+    virtual uint32_t getWidth() = 0;
+    virtual uint32_t getHeight() = 0;
+    virtual uint32_t getBpp() = 0;
+};
+
+#endif // FRAME_BUFFER_H_
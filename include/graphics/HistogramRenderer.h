@@ -0,0 +1,246 @@
+#ifndef HISTOGRAM_RENDERER_H_
+#define HISTOGRAM_RENDERER_H_
+
+#include <stdint.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "common/verify.h"
+#include "graphics/FrameBuffer.h"
+
+
+// Maps bin counts to 0x00RRGGBB pixels: black -> red -> yellow -> white
+// along sqrt(count / maxCount).  Four bins per step with SSE2.
+class HeatColorMap
+{
+public:
+    static void map(const uint32_t* pCounts, uint32_t* pPixels, unsigned num, uint32_t maxCount)
+    {
+        float scale = 765.0f / sqrtf(static_cast<float>(std::max<uint32_t>(maxCount, 1)));
+        unsigned i = 0;
+
+#ifdef __SSE2__
+        const __m128 vScale = _mm_set1_ps(scale);
+        const __m128 vZero = _mm_setzero_ps();
+        const __m128 vMax = _mm_set1_ps(255.0f);
+        const __m128 v255 = _mm_set1_ps(255.0f);
+        const __m128 v510 = _mm_set1_ps(510.0f);
+        const __m128 v65536 = _mm_set1_ps(65536.0f);
+        const __m128i vLow = _mm_set1_epi32(0xffff);
+
+        for (; i + 4 <= num; i += 4)
+        {
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pCounts + i));
+
+            // SSE2 converts signed only: the counts as 65536 * high + low
+            __m128 count = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(c, 16)), v65536),
+                                      _mm_cvtepi32_ps(_mm_and_si128(c, vLow)));
+            __m128 v = _mm_mul_ps(_mm_sqrt_ps(count), vScale);
+
+            __m128i r = _mm_cvttps_epi32(_mm_min_ps(v, vMax));
+            __m128i g = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_sub_ps(v, v255), vZero), vMax));
+            __m128i b = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_sub_ps(v, v510), vZero), vMax));
+
+            __m128i pixel = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 16), _mm_slli_epi32(g, 8)), b);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(pPixels + i), pixel);
+        }
+#endif
+
+        for (; i < num; ++i)
+        {
+            float v = sqrtf(static_cast<float>(pCounts[i])) * scale;
+
+            uint32_t r = static_cast<uint32_t>(std::min(v, 255.0f));
+            uint32_t g = static_cast<uint32_t>(std::min(std::max(v - 255.0f, 0.0f), 255.0f));
+            uint32_t b = static_cast<uint32_t>(std::min(std::max(v - 510.0f, 0.0f), 255.0f));
+
+            pPixels[i] = (r << 16) | (g << 8) | b;
+        }
+    }
+};
+
+
+// Histogram over [lo, hi) which is updated as samples arrive; rendering
+// costs O(bins + pixels) whatever the number of samples added so far.
+class Histogram1D
+{
+public:
+    Histogram1D(unsigned numOfBins, double lo, double hi)
+        : m_counts(numOfBins), m_colors(numOfBins), m_lo(lo), m_scale(numOfBins / (hi - lo)),
+          m_maxCount(0), m_numOfSamples(0), m_numOfOutliers(0)
+    {
+        VERIFY(numOfBins > 0 && hi > lo);
+    }
+
+    void add(double v)
+    {
+        double b = (v - m_lo) * m_scale;
+
+        if (!(b >= 0.0 && b < m_counts.size()))
+        {
+            ++m_numOfOutliers;
+            return;
+        }
+
+        uint32_t count = ++m_counts[static_cast<unsigned>(b)];
+        m_maxCount = std::max(m_maxCount, count);
+        ++m_numOfSamples;
+    }
+
+    void add(const double* pValues, unsigned num, unsigned stride = 1)
+    {
+        for (unsigned i = 0; i < num; ++i)
+            add(pValues[i * stride]);
+    }
+
+    void clear()
+    {
+        std::fill(m_counts.begin(), m_counts.end(), 0);
+        m_maxCount = 0;
+        m_numOfSamples = 0;
+        m_numOfOutliers = 0;
+    }
+
+    // bars with the height and color of the bin count
+    void render(IFrameBuffer& frameBuffer, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+    {
+        VERIFY(frameBuffer.getBpp() == 4);
+        VERIFY(x + width <= frameBuffer.getWidth() && y + height <= frameBuffer.getHeight());
+
+        HeatColorMap::map(&m_counts[0], &m_colors[0], m_counts.size(), m_maxCount);
+
+        m_column.resize(width);
+        m_columnHeight.resize(width);
+
+        for (uint32_t i = 0; i < width; ++i)
+        {
+            m_column[i] = static_cast<uint64_t>(i) * m_counts.size() / width;
+            m_columnHeight[i] = m_maxCount ? static_cast<uint32_t>(static_cast<uint64_t>(m_counts[m_column[i]]) * height / m_maxCount) : 0;
+        }
+
+        for (uint32_t j = 0; j < height; ++j)
+        {
+            uint32_t* p = reinterpret_cast<uint32_t*>(frameBuffer.getBuffer(x, y + j));
+            uint32_t level = height - j;
+
+            for (uint32_t i = 0; i < width; ++i)
+                p[i] = (m_columnHeight[i] >= level) ? m_colors[m_column[i]] : 0;
+        }
+    }
+
+    const std::vector<uint32_t>& getCounts() const { return m_counts; }
+    uint32_t getMaxCount() const { return m_maxCount; }
+    uint64_t getNumOfSamples() const { return m_numOfSamples; }
+    uint64_t getNumOfOutliers() const { return m_numOfOutliers; }
+
+private:
+    std::vector<uint32_t> m_counts;
+    std::vector<uint32_t> m_colors;
+    std::vector<uint32_t> m_column;
+    std::vector<uint32_t> m_columnHeight;
+
+    double m_lo;
+    double m_scale;
+
+    uint32_t m_maxCount;
+    uint64_t m_numOfSamples;
+    uint64_t m_numOfOutliers;
+};
+
+
+// 2-D histogram over [xlo, xhi) x [ylo, yhi) rendered as a density image
+// (y grows upwards), updated incrementally like Histogram1D.
+class Histogram2D
+{
+public:
+    Histogram2D(unsigned numOfBinsX, unsigned numOfBinsY, double xlo, double xhi, double ylo, double yhi)
+        : m_numOfBinsX(numOfBinsX), m_numOfBinsY(numOfBinsY),
+          m_counts(numOfBinsX * numOfBinsY), m_colors(numOfBinsX * numOfBinsY),
+          m_xlo(xlo), m_ylo(ylo), m_xscale(numOfBinsX / (xhi - xlo)), m_yscale(numOfBinsY / (yhi - ylo)),
+          m_maxCount(0), m_numOfSamples(0), m_numOfOutliers(0)
+    {
+        VERIFY(numOfBinsX > 0 && numOfBinsY > 0 && xhi > xlo && yhi > ylo);
+    }
+
+    void add(double x, double y)
+    {
+        double bx = (x - m_xlo) * m_xscale;
+        double by = (y - m_ylo) * m_yscale;
+
+        if (!(bx >= 0.0 && bx < m_numOfBinsX && by >= 0.0 && by < m_numOfBinsY))
+        {
+            ++m_numOfOutliers;
+            return;
+        }
+
+        uint32_t count = ++m_counts[static_cast<unsigned>(by) * m_numOfBinsX + static_cast<unsigned>(bx)];
+        m_maxCount = std::max(m_maxCount, count);
+        ++m_numOfSamples;
+    }
+
+    void add(const double* pX, const double* pY, unsigned num, unsigned stride = 1)
+    {
+        for (unsigned i = 0; i < num; ++i)
+            add(pX[i * stride], pY[i * stride]);
+    }
+
+    void clear()
+    {
+        std::fill(m_counts.begin(), m_counts.end(), 0);
+        m_maxCount = 0;
+        m_numOfSamples = 0;
+        m_numOfOutliers = 0;
+    }
+
+    void render(IFrameBuffer& frameBuffer, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+    {
+        VERIFY(frameBuffer.getBpp() == 4);
+        VERIFY(x + width <= frameBuffer.getWidth() && y + height <= frameBuffer.getHeight());
+
+        HeatColorMap::map(&m_counts[0], &m_colors[0], m_counts.size(), m_maxCount);
+
+        m_column.resize(width);
+
+        for (uint32_t i = 0; i < width; ++i)
+            m_column[i] = static_cast<uint64_t>(i) * m_numOfBinsX / width;
+
+        for (uint32_t j = 0; j < height; ++j)
+        {
+            uint32_t* p = reinterpret_cast<uint32_t*>(frameBuffer.getBuffer(x, y + j));
+            const uint32_t* pRow = &m_colors[0] + (static_cast<uint64_t>(height - 1 - j) * m_numOfBinsY / height) * m_numOfBinsX;
+
+            for (uint32_t i = 0; i < width; ++i)
+                p[i] = pRow[m_column[i]];
+        }
+    }
+
+    const std::vector<uint32_t>& getCounts() const { return m_counts; }
+    uint32_t getMaxCount() const { return m_maxCount; }
+    uint64_t getNumOfSamples() const { return m_numOfSamples; }
+    uint64_t getNumOfOutliers() const { return m_numOfOutliers; }
+
+private:
+    unsigned m_numOfBinsX;
+    unsigned m_numOfBinsY;
+
+    std::vector<uint32_t> m_counts;     // [y][x]
+    std::vector<uint32_t> m_colors;
+    std::vector<uint32_t> m_column;
+
+    double m_xlo;
+    double m_ylo;
+    double m_xscale;
+    double m_yscale;
+
+    uint32_t m_maxCount;
+    uint64_t m_numOfSamples;
+    uint64_t m_numOfOutliers;
+};
+
+
+#endif // HISTOGRAM_RENDERER_H_
@@ -0,0 +1,74 @@
+#ifndef PPM_FRAME_BUFFER_H_
+#define PPM_FRAME_BUFFER_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+
+#include "common/verify.h"
+#include "common/FileDescriptor.h"
+#include "graphics/FrameBuffer.h"
+
+// Headless frame buffer: every flip() writes the frame to a binary PPM
+// file named from pattern (printf style, e.g. "frame%06u.ppm", given the
+// frame number), so the same rendering code runs without an X display.
+class PpmFrameBuffer : public IFrameBuffer
+{
+private:
+    static const uint32_t m_bpp = 4;
+
+    uint32_t m_width;
+    uint32_t m_height;
+
+    const char* m_pPattern;
+    unsigned m_frameCount;
+
+    std::vector<uint8_t> m_frameBuffer;
+    std::vector<uint8_t> m_line;
+
+public:
+    PpmFrameBuffer(uint32_t width, uint32_t height, const char* pPattern)
+        : m_width(width),
+          m_height(height),
+          m_pPattern(pPattern),
+          m_frameCount(0),
+          m_frameBuffer(width * height * m_bpp),
+          m_line(width * 3)
+    {
+        VERIFY(pPattern != 0);
+    }
+
+    void flip()
+    {
+        char filename[1024];
+        snprintf(filename, sizeof(filename), m_pPattern, m_frameCount++);
+
+        FileWriter file(filename);
+
+        fprintf(file, "P6\n%u %u\n255\n", m_width, m_height);
+
+        for (uint32_t y = 0; y < m_height; ++y)
+        {
+            const uint32_t* pSrc = reinterpret_cast<const uint32_t*>(getBuffer(0, y));
+
+            for (uint32_t x = 0; x < m_width; ++x)
+            {
+                m_line[x * 3 + 0] = (pSrc[x] >> 16) & 0xff;
+                m_line[x * 3 + 1] = (pSrc[x] >> 8) & 0xff;
+                m_line[x * 3 + 2] = pSrc[x] & 0xff;
+            }
+
+            VERIFY(fwrite(&m_line[0], 1, m_line.size(), file) == m_line.size());
+        }
+    }
+
+    unsigned getFrameCount() { return m_frameCount; }
+
+    uint8_t* getBuffer(uint32_t x = 0, uint32_t y = 0) { return &m_frameBuffer[0] + (y * m_width + x) * m_bpp; }
+    uint32_t getWidth() { return m_width; }
+    uint32_t getHeight() { return m_height; }
+    uint32_t getBpp() { return m_bpp; }
+};
+
+#endif // PPM_FRAME_BUFFER_H_
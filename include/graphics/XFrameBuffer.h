@@ -6,14 +6,20 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
+#include <algorithm>
 #include <stdint.h>
+#include <string.h>     // memcpy()
+#include <sys/ipc.h>
+#include <sys/shm.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>  // XmbSetWMProperties()
+#include <X11/extensions/XShm.h>    // link with -lXext
 
 #include "common/verify.h"
+#include "graphics/FrameBuffer.h"
 
-class XFrameBuffer
+class XFrameBuffer : public IFrameBuffer
 {
 private:
     static const uint32_t m_bpp = 4;
@@ -29,6 +35,29 @@ private:
     Display* m_pDisplay;
     uint8_t* m_pFrameBuffer;
 
+    // MIT-SHM path: two shared images, m_pFrameBuffer is the back one
+    bool m_isShm;
+    XImage* m_pShmImage[2];
+    XShmSegmentInfo m_shmInfo[2];
+    bool m_isPending[2];
+    unsigned m_current;
+    int m_completionType;
+
+    // dirty rectangle of the current frame [x0, x1) x [y0, y1)
+    uint32_t m_dirtyX0, m_dirtyY0, m_dirtyX1, m_dirtyY1;
+
+    static bool& shmError()
+    {
+        static bool s_isError = false;
+        return s_isError;
+    }
+
+    static int shmErrorHandler(Display*, XErrorEvent*)
+    {
+        shmError() = true;
+        return 0;
+    }
+
 public:
     XFrameBuffer(uint32_t width, uint32_t height)
         : m_width(width),
@@ -36,8 +65,19 @@ public:
           m_isWindowReady(false),
           m_pXimage(0),
           m_pDisplay(0),
-          m_pFrameBuffer(0)
+          m_pFrameBuffer(0),
+          m_isShm(false),
+          m_current(0),
+          m_completionType(0)
     {
+        for (unsigned i = 0; i < 2; ++i)
+        {
+            m_pShmImage[i] = 0;
+            m_shmInfo[i].shmaddr = (char*)-1;
+            m_isPending[i] = false;
+        }
+
+        resetDirty();
     }
 
     ~XFrameBuffer()
@@ -69,35 +109,51 @@ public:
         XMapWindow(m_pDisplay, m_window);
         XFlush(m_pDisplay);
 
-        if (!(m_pFrameBuffer = (uint8_t*)malloc(m_width * m_height * m_bpp)))
+        if (!initShm())
         {
-            fin();
-            VERIFY(0);
-        }
+            if (!(m_pFrameBuffer = (uint8_t*)malloc(m_width * m_height * m_bpp)))
+            {
+                fin();
+                VERIFY(0);
+            }
 
-        if (!(m_pXimage = XCreateImage(m_pDisplay, CopyFromParent, DefaultDepth(m_pDisplay, DefaultScreen(m_pDisplay)),
-                                       ZPixmap, 0, (char*)m_pFrameBuffer, m_width, m_height, m_bpp * 8, m_bpp * m_width)))
-        {
-            fin();
-            VERIFY(0);
+            if (!(m_pXimage = XCreateImage(m_pDisplay, CopyFromParent, DefaultDepth(m_pDisplay, DefaultScreen(m_pDisplay)),
+                                           ZPixmap, 0, (char*)m_pFrameBuffer, m_width, m_height, m_bpp * 8, m_bpp * m_width)))
+            {
+                fin();
+                VERIFY(0);
+            }
         }
     
         XGCValues xgcv;
         m_gc = XCreateGC(m_pDisplay, m_window, 0, &xgcv);
         XFlush(m_pDisplay);
         XSync(m_pDisplay, False);
+
+        return true;
     }
 
     void fin()
     {
+        if (m_isShm)
+        {
+            waitCompletion(0);
+            waitCompletion(1);
+        }
+
+        finShm();
+
         if (m_pXimage)
         {
             XFree(m_pXimage);
             m_pXimage = 0;
         }
 
-        free(m_pFrameBuffer);
+        if (!m_isShm)
+            free(m_pFrameBuffer);
+
         m_pFrameBuffer = 0;
+        m_isShm = false;
 
         if (m_pDisplay)
         {
@@ -110,17 +166,183 @@ public:
         }
     }
 
+    // Only the area passed to markDirty() since the last flip() is uploaded;
+    // without any call the whole frame is.
+    void markDirty(uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+    {
+        m_dirtyX0 = std::min(m_dirtyX0, x);
+        m_dirtyY0 = std::min(m_dirtyY0, y);
+        m_dirtyX1 = std::max(m_dirtyX1, std::min(x + width, m_width));
+        m_dirtyY1 = std::max(m_dirtyY1, std::min(y + height, m_height));
+    }
+
     void flip()
     {
-        XPutImage(m_pDisplay, m_window, m_gc, m_pXimage, 0, 0, 0, 0, m_width, m_height);
-        XFlush(m_pDisplay);
-        XSync(m_pDisplay, False);
+        if (m_dirtyX0 >= m_dirtyX1 || m_dirtyY0 >= m_dirtyY1)
+            markDirty(0, 0, m_width, m_height);
+
+        uint32_t x = m_dirtyX0, y = m_dirtyY0;
+        uint32_t width = m_dirtyX1 - m_dirtyX0, height = m_dirtyY1 - m_dirtyY0;
+
+        if (!m_isShm)
+        {
+            XPutImage(m_pDisplay, m_window, m_gc, m_pXimage, x, y, x, y, width, height);
+            XFlush(m_pDisplay);
+            XSync(m_pDisplay, False);
+        }
+        else
+        {
+            // the server reads the shared segment asynchronously and reports
+            // ShmCompletion; drawing continues on the other segment meanwhile
+            XShmPutImage(m_pDisplay, m_window, m_gc, m_pShmImage[m_current], x, y, x, y, width, height, True);
+            XFlush(m_pDisplay);
+            m_isPending[m_current] = true;
+
+            unsigned next = m_current ^ 1;
+            waitCompletion(next);
+
+            // the next back buffer holds the previous frame; bring the
+            // changed area up to date so that drawing can be incremental
+            for (uint32_t j = y; j < y + height; ++j)
+            {
+                memcpy(m_pShmImage[next]->data + (j * m_width + x) * m_bpp,
+                       m_pShmImage[m_current]->data + (j * m_width + x) * m_bpp, width * m_bpp);
+            }
+
+            m_current = next;
+            m_pFrameBuffer = (uint8_t*)m_pShmImage[m_current]->data;
+        }
+
+        resetDirty();
     }
 
+    bool isShm() { return m_isShm; }
+
     uint8_t* getBuffer(uint32_t x = 0, uint32_t y = 0) { return m_pFrameBuffer + (y * m_width + x) * m_bpp; }
     uint32_t getWidth() { return m_width; }
     uint32_t getHeight() { return m_height; }
     uint32_t getBpp() { return m_bpp; }
+
+private:
+    void resetDirty()
+    {
+        m_dirtyX0 = m_width;
+        m_dirtyY0 = m_height;
+        m_dirtyX1 = 0;
+        m_dirtyY1 = 0;
+    }
+
+    // falls back to XPutImage if the extension is missing, the display is
+    // remote or the image layout does not match getBuffer()
+    bool initShm()
+    {
+        if (!XShmQueryExtension(m_pDisplay))
+            return false;
+
+        Visual* pVisual = DefaultVisual(m_pDisplay, DefaultScreen(m_pDisplay));
+        int depth = DefaultDepth(m_pDisplay, DefaultScreen(m_pDisplay));
+
+        for (unsigned i = 0; i < 2; ++i)
+        {
+            m_pShmImage[i] = XShmCreateImage(m_pDisplay, pVisual, depth, ZPixmap, 0, &m_shmInfo[i], m_width, m_height);
+
+            if (!m_pShmImage[i] || m_pShmImage[i]->bytes_per_line != (int)(m_width * m_bpp)
+                || m_pShmImage[i]->bits_per_pixel != (int)(m_bpp * 8))
+            {
+                finShm();
+                return false;
+            }
+
+            m_shmInfo[i].shmid = shmget(IPC_PRIVATE, m_width * m_height * m_bpp, IPC_CREAT | 0600);
+
+            if (m_shmInfo[i].shmid < 0)
+            {
+                finShm();
+                return false;
+            }
+
+            m_shmInfo[i].shmaddr = m_pShmImage[i]->data = (char*)shmat(m_shmInfo[i].shmid, 0, 0);
+            m_shmInfo[i].readOnly = False;
+
+            if (m_shmInfo[i].shmaddr == (char*)-1)
+            {
+                m_pShmImage[i]->data = 0;
+                shmctl(m_shmInfo[i].shmid, IPC_RMID, 0);
+                finShm();
+                return false;
+            }
+
+            shmError() = false;
+            XErrorHandler pOldHandler = XSetErrorHandler(shmErrorHandler);
+            XShmAttach(m_pDisplay, &m_shmInfo[i]);
+            XSync(m_pDisplay, False);
+            XSetErrorHandler(pOldHandler);
+
+            // the segment goes away with the last detach
+            shmctl(m_shmInfo[i].shmid, IPC_RMID, 0);
+
+            if (shmError())
+            {
+                shmdt(m_shmInfo[i].shmaddr);
+                m_shmInfo[i].shmaddr = (char*)-1;
+                m_pShmImage[i]->data = 0;
+                finShm();
+                return false;
+            }
+        }
+
+        m_completionType = XShmGetEventBase(m_pDisplay) + ShmCompletion;
+        m_isShm = true;
+        m_current = 0;
+        m_pFrameBuffer = (uint8_t*)m_pShmImage[0]->data;
+
+        return true;
+    }
+
+    void finShm()
+    {
+        for (unsigned i = 0; i < 2; ++i)
+        {
+            if (m_pShmImage[i])
+            {
+                if (m_shmInfo[i].shmaddr != (char*)-1)
+                {
+                    XShmDetach(m_pDisplay, &m_shmInfo[i]);
+                    XSync(m_pDisplay, False);
+                    shmdt(m_shmInfo[i].shmaddr);
+                    m_shmInfo[i].shmaddr = (char*)-1;
+                }
+
+                m_pShmImage[i]->data = 0;
+                XDestroyImage(m_pShmImage[i]);
+                m_pShmImage[i] = 0;
+            }
+
+            m_isPending[i] = false;
+        }
+    }
+
+    static Bool isCompletion(Display*, XEvent* pEvent, XPointer arg)
+    {
+        return pEvent->type == *(int*)arg;
+    }
+
+    void waitCompletion(unsigned index)
+    {
+        while (m_isPending[index])
+        {
+            XEvent event;
+            XIfEvent(m_pDisplay, &event, isCompletion, (XPointer)&m_completionType);
+
+            XShmCompletionEvent* pCompletion = (XShmCompletionEvent*)&event;
+
+            for (unsigned i = 0; i < 2; ++i)
+            {
+                if (pCompletion->shmseg == m_shmInfo[i].shmseg)
+                    m_isPending[i] = false;
+            }
+        }
+    }
 };
 
 #endif // X_FRAME_BUFFER_H_